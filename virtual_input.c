@@ -1,14 +1,165 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <string.h>
+#include <time.h>
 #include <linux/uinput.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
 #include "virtual_input.h"
+#ifdef VD_GENERATED_KEYMAP
+#include VD_GENERATED_KEYMAP
+#endif
+
+/*
+* virtual_device_trace
+*/
+#define VD_TRACE_MAGIC "VDTRACE1"
+#define VD_TRACE_RING_SIZE 4096 // power of 2
+
+// static USDT probe, a nop until a tracer attaches
+#ifdef DTRACE_PROBE3
+#define VD_PROBE(name, a, b, c) DTRACE_PROBE3(virtual_input, name, a, b, c)
+#else
+#define VD_PROBE(name, a, b, c) do { } while (0)
+#endif
+
+#define VD_TRACE(probe, name, type, code, value) do { \
+	VD_PROBE(name, type, code, value); \
+	if (vd_trace_enabled) \
+		vd_trace_record(probe, type, code, value); \
+} while (0)
+
+static struct vd_trace_record vd_trace_ring[VD_TRACE_RING_SIZE];
+static unsigned int vd_trace_head;
+static unsigned long long vd_trace_start;
+static unsigned long long vd_trace_threshold;
+static int vd_trace_enabled;
+static const char *vd_trace_path;
+static volatile sig_atomic_t vd_trace_pending = 0;
+
+static unsigned long long vd_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// threshold in microseconds, 0 - dump on signal only
+void vd_trace_init(const char *path, unsigned int threshold)
+{
+	vd_trace_path = path;
+	vd_trace_threshold = (unsigned long long)threshold * 1000ULL;
+	vd_trace_head = 0;
+	vd_trace_enabled = (path != NULL);
+}
+
+void vd_trace_record(int probe, int type, int code, int value)
+{
+	struct vd_trace_record *rec;
+	unsigned long long ts;
+
+	ts = vd_trace_now();
+	if (probe == VD_TRACE_READ)
+		vd_trace_start = ts;
+
+	rec = &vd_trace_ring[vd_trace_head++ & (VD_TRACE_RING_SIZE - 1)];
+	rec->ts = ts;
+	rec->latency = (unsigned int)(ts - vd_trace_start);
+	rec->probe = probe;
+	rec->type = type;
+	rec->code = code;
+	rec->reserved = 0;
+	rec->value = value;
+
+	if (probe == VD_TRACE_WRITE && vd_trace_threshold && ts - vd_trace_start > vd_trace_threshold)
+		vd_trace_pending = 1;
+}
+
+// file layout: magic, record size, record count, records from oldest to newest
+int vd_trace_dump(const char *path)
+{
+	FILE *fout;
+	unsigned int count, first, size, i;
+
+	if ((fout = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): open trace file %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		return -1;
+	}
+
+	count = vd_trace_head < VD_TRACE_RING_SIZE ? vd_trace_head : VD_TRACE_RING_SIZE;
+	first = vd_trace_head - count;
+	size = sizeof(struct vd_trace_record);
+	fwrite(VD_TRACE_MAGIC, 1, 8, fout);
+	fwrite(&size, sizeof(size), 1, fout);
+	fwrite(&count, sizeof(count), 1, fout);
+	for (i = 0; i < count; i++)
+		fwrite(&vd_trace_ring[(first + i) & (VD_TRACE_RING_SIZE - 1)], size, 1, fout);
+
+	if (fclose(fout) != 0) {
+		fprintf(stderr, "Error %s (%d) %s(): write trace file %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		return -1;
+	}
+	return 0;
+}
+
+int vd_trace_print(const char *path)
+{
+	static const char * const probes[] = {"?", "read", "lookup", "emit", "write"};
+	FILE *fin;
+	char magic[8];
+	unsigned int size, count, i;
+	struct vd_trace_record rec;
+
+	if ((fin = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): open trace file %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		return -1;
+	}
+
+	if (fread(magic, 1, 8, fin) != 8 || memcmp(magic, VD_TRACE_MAGIC, 8) != 0
+		|| fread(&size, sizeof(size), 1, fin) != 1 || size != sizeof(rec)
+		|| fread(&count, sizeof(count), 1, fin) != 1) {
+		fprintf(stderr, "Error %s (%d) %s(): bad trace file %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		fclose(fin);
+		return -1;
+	}
+
+	for (i = 0; i < count && fread(&rec, sizeof(rec), 1, fin) == 1; i++)
+		fprintf(stdout, "%llu.%09llu %-6s type %02X code %04X value %08X latency %u ns\n",
+				rec.ts / 1000000000ULL, rec.ts % 1000000000ULL,
+				probes[rec.probe <= VD_TRACE_WRITE ? rec.probe : 0],
+				rec.type, rec.code, (unsigned int)rec.value, rec.latency);
+
+	fclose(fin);
+	return 0;
+}
+
+static void trace_handler(int sig)
+{
+	vd_trace_pending = 1;
+}
 
 /*
 * virtual_device_config
@@ -21,6 +172,11 @@
 
 #define ID_NONE 0
 #define ID_CODES 1
+#define ID_KEYS 2
+#define ID_SEQUENCES 3
+
+#define VD_HOLD_TIMEOUT 250
+#define VD_EVENT_BATCH 64
 
 static int config_line;
 static int config_parse_error;
@@ -480,7 +636,7 @@ int vd_config_add_button(struct vd_config *config, char *key, int scancode)
 
 	node = config->vks;
 	while (node != NULL) {
-		if (node->scancode == scancode)
+		if (node->scancode == scancode && node->layer == config->layer)
 			return 0;
 		node = node->next;
 	}
@@ -488,6 +644,8 @@ int vd_config_add_button(struct vd_config *config, char *key, int scancode)
 	node = malloc(sizeof(struct vk_node));
 	node->key = key;
 	node->scancode = scancode;
+	node->layer = config->layer;
+	node->kodi = NULL;
 	// insert at index 0
 	node->next = config->vks;
 	config->vks = node;
@@ -495,10 +653,138 @@ int vd_config_add_button(struct vd_config *config, char *key, int scancode)
 	return 1;
 }
 
+// index of the layer, created if not exist
+// -1 - out of memory
+int vd_config_add_layer(struct vd_config *config, const char *name)
+{
+	struct vd_layer *layers;
+	unsigned int i;
+
+	if (config->layers == NULL) {
+		if ((config->layers = calloc(1, sizeof(struct vd_layer))) == NULL)
+			return -1;
+		config->layers[0].name = "base";
+		config->layer_count = 1;
+	}
+
+	for (i = 0; i < config->layer_count; i++)
+		if (strcasecmp(config->layers[i].name, name) == 0)
+			return i;
+
+	if ((layers = realloc(config->layers, (i + 1) * sizeof(struct vd_layer))) == NULL)
+		return -1;
+	config->layers = layers;
+	config->layers[i].name = s_strdup((char *)name);
+	config->layers[i].table = NULL;
+	config->layer_count = i + 1;
+	return i;
+}
+
+// 0 - already exist
+// 1 - added
+// -1 - out of memory
+int vd_config_add_remap(struct vd_config *config, int code, int to, int modifier)
+{
+	if (config->remap == NULL && (config->remap = calloc(KEY_CNT, sizeof(struct vd_remap))) == NULL)
+		return -1;
+	if (config->remap[code].code)
+		return 0;
+	config->remap[code].code = to;
+	config->remap[code].modifier = modifier > 0 ? modifier : 0;
+	return 1;
+}
+
+static const char * const vd_filter_names[] = {
+	[VD_FILTER_SCANCODE] = "scancode",
+	[VD_FILTER_REMAP] = "remap",
+	[VD_FILTER_TEXT] = "text",
+	[VD_FILTER_CORRECT] = "correct",
+	[VD_FILTER_KODI] = "kodi",
+	[VD_FILTER_SEQUENCE] = "sequence",
+};
+
+// VD_FILTER_*, -1 - unknown
+static int vd_filter_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(vd_filter_names) / sizeof(vd_filter_names[0]); i++)
+		if (strcasecmp(vd_filter_names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+// the keys are the rest of the line after first, still in strtok()
+static int vd_config_add_sequence(struct vd_config *config, const char *action, unsigned int timeout, char *first)
+{
+	struct vd_sequence *seq;
+	char *key;
+
+	seq = realloc(config->sequences, (config->sequence_count + 1) * sizeof(struct vd_sequence));
+	if (seq == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	config->sequences = seq;
+	seq = &config->sequences[config->sequence_count];
+	memset(seq, 0, sizeof(struct vd_sequence));
+	for (key = first; key != NULL; key = strtok(NULL, whitespace)) {
+		if (seq->length == VD_SEQUENCE_MAX)
+			return -1;
+		seq->keys[seq->length++] = s_strdup(key);
+	}
+	seq->action = s_strdup((char *)action);
+	seq->timeout = timeout;
+	config->sequence_count++;
+	return 0;
+}
+
+// text entry settings, allocated on first use
+static struct vd_text *vd_config_text(struct vd_config *config)
+{
+	if (config->text == NULL) {
+		if ((config->text = calloc(1, sizeof(struct vd_text))) == NULL) {
+			fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+			return NULL;
+		}
+		config->text->mode = VD_TEXT_MULTITAP;
+		config->text->timeout = 1000;
+		config->text->last_digit = -1;
+	}
+	return config->text;
+}
+
+// 1 - one of the text entry keys
+static int vd_config_text_key(const char *key)
+{
+	static const char * const names[] = {"text", "text_dict", "text_toggle", "text_next", "text_timeout"};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (strcasecmp(names[i], key) == 0)
+			return 1;
+	return 0;
+}
+
+// "mode:layer" key name to VD_LAYER_*, 0 - not a layer switch
+static int vd_layer_mode(const char *key, const char **name)
+{
+	static const char * const modes[] = {NULL, "momentary:", "toggle:", "oneshot:"};
+	int mode;
+
+	for (mode = VD_LAYER_MOMENTARY; mode <= VD_LAYER_ONESHOT; mode++)
+		if (strncasecmp(key, modes[mode], strlen(modes[mode])) == 0) {
+			*name = key + strlen(modes[mode]);
+			return mode;
+		}
+	return 0;
+}
+
 int vd_config_read(FILE * f, struct vd_config *config)
 {
 	char buf[LINE_LEN + 1], *key, *val, *val2;
-	int len, argc, cur;
+	const char *name;
+	int len, argc, cur, ret, code;
 
 	cur = ID_NONE;
 	config_line = 0;
@@ -540,18 +826,137 @@ int vd_config_read(FILE * f, struct vd_config *config)
 			} else if (strcasecmp("input", key) == 0) {
 				if (config->input == NULL)
 					config->input = s_strdup(val);
+			} else if (strcasecmp("merge", key) == 0) {
+				if (config->merge_count == VD_MERGE_MAX - 1) {
+					fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, too many merge devices\n", __FILE__, __LINE__, __FUNCTION__, config_line);
+					config_parse_error = 1;
+				} else {
+					config->merge[config->merge_count++] = s_strdup(val);
+				}
+			} else if (strcasecmp("kodi", key) == 0) {
+				if (config->kodi == NULL)
+					config->kodi = s_strdup(val);
+				if (val2 != NULL)
+					config->kodi_port = s_strtoi(val2);
+			} else if (strcasecmp("merge_window", key) == 0) {
+				config->merge_window = s_strtoi(val);
+			} else if (strcasecmp("input_cache", key) == 0) {
+				if (config->input_cache == NULL)
+					config->input_cache = s_strdup(val);
+			} else if (strcasecmp("trace", key) == 0) {
+				if (config->trace == NULL)
+					config->trace = s_strdup(val);
+			} else if (strcasecmp("trace_threshold", key) == 0) {
+				config->trace_threshold = s_strtoi(val);
+			} else if (strcasecmp("publish", key) == 0) {
+				if (config->publish == NULL)
+					config->publish = s_strdup(val);
+			} else if (strcasecmp("publish_queue", key) == 0) {
+				config->publish_queue = s_strtoi(val);
+			} else if (strcasecmp("publish_policy", key) == 0) {
+				if (strcasecmp("drop-oldest", val) == 0) {
+					config->publish_policy = VD_PUBLISH_DROP_OLDEST;
+				} else if (strcasecmp("disconnect", val) == 0) {
+					config->publish_policy = VD_PUBLISH_DISCONNECT;
+				} else {
+					fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, unknown policy %s\n", __FILE__, __LINE__, __FUNCTION__, config_line, val);
+					config_parse_error = 1;
+				}
+			} else if (strcasecmp("passthrough", key) == 0) {
+				config->passthrough = strcasecmp("yes", val) == 0 || strcmp("1", val) == 0;
+			} else if (strcasecmp("filter", key) == 0) {
+				if ((ret = vd_filter_find(val)) < 0 || config->filter_count == VD_FILTER_MAX) {
+					fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, bad filter %s\n", __FILE__, __LINE__, __FUNCTION__, config_line, val);
+					config_parse_error = 1;
+				} else {
+					config->filters[config->filter_count++] = ret;
+				}
+			} else if (vd_config_text_key(key) && vd_config_text(config) == NULL) {
+				config_parse_error = 1;
+			} else if (strcasecmp("text", key) == 0) {
+				if (strcasecmp("t9", val) == 0) {
+					config->text->mode = VD_TEXT_T9;
+				} else if (strcasecmp("multitap", val) == 0) {
+					config->text->mode = VD_TEXT_MULTITAP;
+				} else {
+					fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, unknown text mode %s\n", __FILE__, __LINE__, __FUNCTION__, config_line, val);
+					config_parse_error = 1;
+				}
+			} else if (strcasecmp("text_dict", key) == 0) {
+				if (config->text->dict_path == NULL)
+					config->text->dict_path = s_strdup(val);
+			} else if (strcasecmp("text_toggle", key) == 0) {
+				config->text->toggle = get_input_code(val);
+			} else if (strcasecmp("text_next", key) == 0) {
+				config->text->next = get_input_code(val);
+			} else if (strcasecmp("text_timeout", key) == 0) {
+				config->text->timeout = s_strtoi(val);
+			} else if (strcasecmp("output_queue", key) == 0) {
+				config->output_queue = s_strtoi(val);
+			} else if (strcasecmp("correct", key) == 0) {
+				config->correct = s_strtoi(val);
+			} else if (strcasecmp("hold_timeout", key) == 0) {
+				config->hold_timeout = s_strtoi(val);
 			} else if (strcasecmp("begin", key) == 0 && strcasecmp("codes", val) == 0) {
+				config->layer = 0;
 				cur = ID_CODES;
 			} else if (strcasecmp("end", key) == 0 && strcasecmp("codes", val) == 0) {
 				cur = ID_NONE;
+			} else if (strcasecmp("begin", key) == 0 && strcasecmp("layer", val) == 0) {
+				if (val2 == NULL || (ret = vd_config_add_layer(config, val2)) < 0) {
+					fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, bad layer\n", __FILE__, __LINE__, __FUNCTION__, config_line);
+					config_parse_error = 1;
+					break;
+				}
+				config->layer = ret;
+				cur = ID_CODES;
+			} else if (strcasecmp("end", key) == 0 && strcasecmp("layer", val) == 0) {
+				config->layer = 0;
+				cur = ID_NONE;
+			} else if (strcasecmp("begin", key) == 0 && strcasecmp("sequences", val) == 0) {
+				cur = ID_SEQUENCES;
+			} else if (strcasecmp("end", key) == 0 && strcasecmp("sequences", val) == 0) {
+				cur = ID_NONE;
+			} else if (strcasecmp("begin", key) == 0 && strcasecmp("keys", val) == 0) {
+				cur = ID_KEYS;
+			} else if (strcasecmp("end", key) == 0 && strcasecmp("keys", val) == 0) {
+				cur = ID_NONE;
 			} else {
 				switch (cur) {
 				case ID_CODES:
-					if (get_input_code(key) != 0) {
+					if (vd_layer_mode(key, &name)) {
 						vd_config_add_button(config, s_strdup(key), s_strtoi(val));
+					} else if (get_input_code(key) != 0) {
+						// KEY SCANCODE [kodi[:MAP:name]]
+						if (vd_config_add_button(config, s_strdup(key), s_strtoi(val)) && val2 != NULL) {
+							if (strcasecmp("kodi", val2) == 0)
+								config->vks->kodi = s_strdup("");
+							else if (strncasecmp("kodi:", val2, 5) == 0 && strchr(val2 + 5, ':') != NULL)
+								config->vks->kodi = s_strdup(val2 + 5);
+							else
+								fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, unknown output %s\n", __FILE__, __LINE__, __FUNCTION__, config_line, val2);
+						}
 					} else {
 						fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, button %s not exist in list\n", __FILE__, __LINE__, __FUNCTION__, config_line, key);
 					}
+					break;
+				case ID_SEQUENCES:
+					// ACTION TIMEOUT KEY1 KEY2 ...
+					if (val2 == NULL || vd_config_add_sequence(config, key, s_strtoi(val), val2) < 0) {
+						fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, bad sequence\n", __FILE__, __LINE__, __FUNCTION__, config_line);
+						config_parse_error = 1;
+					}
+					break;
+				case ID_KEYS:
+					// KEY_FROM KEY_TO [KEY_MODIFIER]
+					if ((code = get_input_code(key)) <= 0 || (ret = get_input_code(val)) <= 0
+						|| (val2 != NULL && get_input_code(val2) <= 0)) {
+						fprintf(stderr, "Error %s (%d) %s(): in configfile line %d, button not exist in list\n", __FILE__, __LINE__, __FUNCTION__, config_line);
+					} else if (vd_config_add_remap(config, code, ret, val2 != NULL ? get_input_code(val2) : 0) < 0) {
+						fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+						config_parse_error = 1;
+					}
+					break;
 				}
 			}
 		} else {
@@ -564,13 +969,26 @@ int vd_config_read(FILE * f, struct vd_config *config)
 		}
 	}
 
+	config->layer = 0;
 	return config_parse_error;
 }
 
+static void vd_config_save_button(FILE *fout, struct vk_node *node)
+{
+	if (node->kodi == NULL)
+		fprintf(fout, "  %-20s 0x%08X\n", node->key, node->scancode);
+	else if (node->kodi[0] == 0)
+		fprintf(fout, "  %-20s 0x%08X kodi\n", node->key, node->scancode);
+	else
+		fprintf(fout, "  %-20s 0x%08X kodi:%s\n", node->key, node->scancode, node->kodi);
+}
+
 int vd_config_save(const char *filename, struct vd_config *config)
 {
 	FILE *fout;
 	struct vk_node *node;
+	unsigned int i;
+	int j;
 
 	if ((fout = fopen(filename, "w")) == NULL) {
 		fprintf(stderr, "Error %s (%d) %s(): save config to %s failed.\n", __FILE__, __LINE__, __FUNCTION__, filename);
@@ -579,40 +997,156 @@ int vd_config_save(const char *filename, struct vd_config *config)
 
 	fprintf(fout, "name %s\n", config->name);
 	fprintf(fout, "input %s\n", config->input);
+	for (i = 0; i < config->merge_count; i++)
+		fprintf(fout, "merge %s\n", config->merge[i]);
+	if (config->merge_window)
+		fprintf(fout, "merge_window %u\n", config->merge_window);
+	if (config->input_cache != NULL)
+		fprintf(fout, "input_cache %s\n", config->input_cache);
+	if (config->trace != NULL)
+		fprintf(fout, "trace %s\n", config->trace);
+	if (config->trace_threshold)
+		fprintf(fout, "trace_threshold %u\n", config->trace_threshold);
+
+	if (config->hold_timeout)
+		fprintf(fout, "hold_timeout %u\n", config->hold_timeout);
+	if (config->passthrough)
+		fprintf(fout, "passthrough yes\n");
+	if (config->correct)
+		fprintf(fout, "correct %u\n", config->correct);
+	if (config->output_queue)
+		fprintf(fout, "output_queue %u\n", config->output_queue);
+	for (i = 0; i < config->filter_count; i++)
+		fprintf(fout, "filter %s\n", vd_filter_names[config->filters[i]]);
+	if (config->text != NULL) {
+		fprintf(fout, "text %s\n", config->text->mode == VD_TEXT_T9 ? "t9" : "multitap");
+		if (config->text->dict_path != NULL)
+			fprintf(fout, "text_dict %s\n", config->text->dict_path);
+		if (config->text->toggle > 0 && get_input_name(config->text->toggle) != NULL)
+			fprintf(fout, "text_toggle %s\n", get_input_name(config->text->toggle));
+		if (config->text->next > 0 && get_input_name(config->text->next) != NULL)
+			fprintf(fout, "text_next %s\n", get_input_name(config->text->next));
+		fprintf(fout, "text_timeout %u\n", config->text->timeout);
+	}
+	if (config->publish != NULL) {
+		fprintf(fout, "publish %s\n", config->publish);
+		if (config->publish_queue)
+			fprintf(fout, "publish_queue %u\n", config->publish_queue);
+		if (config->publish_policy == VD_PUBLISH_DISCONNECT)
+			fprintf(fout, "publish_policy disconnect\n");
+	}
+
+	if (config->kodi != NULL)
+		fprintf(fout, "kodi %s %u\n", config->kodi, config->kodi_port ? config->kodi_port : VD_KODI_PORT);
 
 	node = config->vks;
 	fprintf(fout, "begin codes\n");
 	while (node != NULL) {
-		fprintf(fout, "  %-20s 0x%08X\n", node->key, node->scancode);
+		if (node->layer == 0)
+			vd_config_save_button(fout, node);
 		node = node->next;
 	}
 	fprintf(fout, "end codes\n");
+
+	if (config->remap != NULL) {
+		fprintf(fout, "\nbegin keys\n");
+		for (i = 0; i < KEY_CNT; i++) {
+			// the keys block takes names only, a code without one can not be read back
+			if (get_input_name(i) == NULL || get_input_name(config->remap[i].code) == NULL)
+				continue;
+			if (config->remap[i].modifier && get_input_name(config->remap[i].modifier) != NULL)
+				fprintf(fout, "  %-20s %-20s %s\n", get_input_name(i), get_input_name(config->remap[i].code),
+						get_input_name(config->remap[i].modifier));
+			else if (!config->remap[i].modifier)
+				fprintf(fout, "  %-20s %s\n", get_input_name(i), get_input_name(config->remap[i].code));
+		}
+		fprintf(fout, "end keys\n");
+	}
+
+	if (config->sequence_count) {
+		fprintf(fout, "\nbegin sequences\n");
+		for (i = 0; i < config->sequence_count; i++) {
+			fprintf(fout, "  %-20s %u", config->sequences[i].action, config->sequences[i].timeout);
+			for (j = 0; j < config->sequences[i].length; j++)
+				fprintf(fout, " %s", config->sequences[i].keys[j]);
+			fprintf(fout, "\n");
+		}
+		fprintf(fout, "end sequences\n");
+	}
+
+	for (i = 1; i < config->layer_count; i++) {
+		fprintf(fout, "\nbegin layer %s\n", config->layers[i].name);
+		for (node = config->vks; node != NULL; node = node->next)
+			if (node->layer == i)
+				vd_config_save_button(fout, node);
+		fprintf(fout, "end layer\n");
+	}
 	fflush(fout);
 	fclose(fout);
 	return 0;
 }
 
+// table entry of the key node, 0 - unknown
+static int vd_config_entry(struct vd_config *config, struct vk_node *node)
+{
+	const char *name;
+	unsigned int i;
+	int mode, code;
+
+	if ((mode = vd_layer_mode(node->key, &name)) != 0) {
+		for (i = 0; i < config->layer_count; i++)
+			if (strcasecmp(config->layers[i].name, name) == 0)
+				return VD_LAYER_ACTION(mode, i);
+		fprintf(stderr, "Error %s (%d) %s(): unknown layer %s, 0x%08X\n", __FILE__, __LINE__, __FUNCTION__, node->key, node->scancode);
+		return 0;
+	}
+	code = get_input_code(node->key);
+	return code > 0 ? code : 0;
+}
+
+static void vd_config_table_free(struct vd_config *config)
+{
+	unsigned int i;
+
+	for (i = 0; i < config->layer_count; i++) {
+		free(config->layers[i].table);
+		config->layers[i].table = NULL;
+	}
+	config->table = NULL;
+	// empty range, lookups never hit the table
+	config->min = INT_MAX;
+	config->max = 0;
+}
+
+// every layer gets its own table over the same scancode range,
+// other layers inherit the base layer entries they do not redefine
 void vd_config_table_rebuild(struct vd_config *config)
 {
-	unsigned int size;
+	unsigned int size, i;
 	struct vk_node *node;
 
 	if (config == NULL)
 		return;
 
-	if (config->table != NULL)
-		free(config->table);
+	if (config->layers == NULL && vd_config_add_layer(config, "base") < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		return;
+	}
+
+	vd_config_table_free(config);
+	config->layer_base = 0;
+	config->layer_oneshot = 0;
+	config->layer_momentary = 0;
 
 	if ((node = config->vks) == NULL)
 		return;
 
 	// calc min max
-	config->min = INT_MAX;
 	while (node != NULL)
 	{
 		if (node->scancode < config->min)
 			config->min = node->scancode;
-		else if (node->scancode > config->max)
+		if (node->scancode > config->max)
 			config->max = node->scancode;
 		node = node->next;
 	}
@@ -621,134 +1155,1456 @@ void vd_config_table_rebuild(struct vd_config *config)
 	size = config->max - config->min;
 	if (size > 0xFFFF) {
 		fprintf(stderr, "Error %s (%d) %s(): big size of keys table, %d\n", __FILE__, __LINE__, __FUNCTION__, size);
+		vd_config_table_free(config);
 		return;
 	}
-	size = size * sizeof(config->table);
-	config->table = malloc(sizeof(config->table));
-	memset(config->table, 0, size);
+	size = (size + 1) * sizeof(*config->table);
+	for (i = 0; i < config->layer_count; i++) {
+		if ((config->layers[i].table = malloc(size)) == NULL) {
+			fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+			vd_config_table_free(config);
+			return;
+		}
+		memset(config->layers[i].table, 0, size);
+	}
 
 	node = config->vks;
 	while (node != NULL)
 	{
-		config->table[node->scancode - config->min] = get_input_code(node->key);
+		if (node->layer == 0)
+			config->layers[0].table[node->scancode - config->min] = vd_config_entry(config, node);
 		node = node->next;
 	}
-}
-
-/*
-* virtual_device
-*/
-int vd_create(struct vd_config *config)
-{
-	int fd, keycode;
-	struct vk_node *node;
-	struct uinput_user_dev vd_uinput;
-
-	if ((fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK)) < 0) {
-		fprintf(stderr, "Error %s (%d) %s(): could not open %s\n", __FILE__, __LINE__, __FUNCTION__, "/dev/uinput");
-		return -1;
-	}
-
-	if (ioctl(fd, UI_SET_EVBIT, EV_KEY) == -1) {
-		fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_EVBIT, EV_KEY)\n", __FILE__, __LINE__, __FUNCTION__);
-		close(fd);
-		return -1;
-	}
 
-	if (ioctl(fd, UI_SET_EVBIT, EV_SYN) == -1) {
-		fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_EVBIT, EV_SYN)\n", __FILE__, __LINE__, __FUNCTION__);
-		close(fd);
-		return -1;
-	}
+	for (i = 1; i < config->layer_count; i++)
+		memcpy(config->layers[i].table, config->layers[0].table, size);
 
 	node = config->vks;
 	while (node != NULL)
 	{
-		if ((keycode = get_input_code(node->key)) != -1) {
-			if (ioctl(fd, UI_SET_KEYBIT, keycode) == -1) {
-				fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_KEYBIT, %d)\n", __FILE__, __LINE__, __FUNCTION__, keycode);
-				close(fd);
-				return -1;
-			}
-		} else {
-			fprintf(stderr, "Error %s (%d) %s(): unknown key name %s, %d\n", __FILE__, __LINE__, __FUNCTION__, node->key, node->scancode);
-		}
+		if (node->layer != 0)
+			config->layers[node->layer].table[node->scancode - config->min] = vd_config_entry(config, node);
 		node = node->next;
 	}
 
-	memset(&vd_uinput, 0, sizeof(struct uinput_user_dev));
-	strncpy(vd_uinput.name, config->name, UINPUT_MAX_NAME_SIZE);
-	vd_uinput.id.bustype	= BUS_USB;
-	vd_uinput.id.vendor		= 0x99a; /* dummy vendor */
-	vd_uinput.id.product	= 0x7501; /* dummy product */
-	vd_uinput.id.version	= 0x100;
-	//if (config->phys != NULL)
-	//	vd_uinput.id.phys = "sunxi_ir_keyboard/input0";
+	vd_config_layer_select(config, 0);
+}
 
-	if (write(fd, &vd_uinput, sizeof(vd_uinput)) < 0) {
-		fprintf(stderr, "Error %s (%d) %s(): setup virtual device\n", __FILE__, __LINE__, __FUNCTION__);
-		close(fd);
-		return -1;
-	}
+void vd_config_layer_select(struct vd_config *config, unsigned int layer)
+{
+	config->layer_active = layer;
+	config->table = config->layers[layer].table;
+}
 
-	if (ioctl(fd, UI_DEV_CREATE) == -1) {
-		fprintf(stderr, "Error %s (%d) %s(): create virtual device\n", __FILE__, __LINE__, __FUNCTION__);
-		close(fd);
-		return -1;
+// keycode for the scancode in the active layer, 0 - unmapped, -1 - layer switch
+int vd_config_lookup(struct vd_config *config, int scancode, const struct timeval *time)
+{
+	unsigned int index = scancode;
+	int entry;
+
+	if (config->layer_momentary && timercmp(time, &config->layer_hold, >)) {
+		config->layer_momentary = 0;
+		vd_config_layer_select(config, config->layer_base);
 	}
 
-	sleep(1);
+	config->layer_lookup = config->layer_active;
+#ifdef VD_GENERATED_KEYMAP
+	entry = vd_generated_lookup(config->layer_active, index);
+#else
+	if (index < config->min || index > config->max)
+		return 0;
 
-	return fd;
+	entry = config->table[index - config->min];
+#endif
+	VD_TRACE(VD_TRACE_LOOKUP, lookup, EV_MSC, entry, scancode);
+	return vd_config_action(config, entry, time);
 }
 
-void vd_send_event(int fd, int type, int code, int value)//, long tv_sec, long tv_usec)
+// keycode of the table entry, layer switches are done here, 0 - none, -1 - layer switch
+int vd_config_action(struct vd_config *config, int entry, const struct timeval *time)
 {
-	struct input_event ev;
-	ev.type = type;
-	ev.code = code;
-	ev.value = value;
-	//ev.time.tv_sec = 0;
-	//ev.time.tv_usec = 0;
-	if (write(fd, &ev, sizeof(ev)) < 0)
-		fprintf(stderr, "Error %s (%d) %s(): write()\n", __FILE__, __LINE__, __FUNCTION__);
-}
+	unsigned int layer, hold;
 
-void vd_destroy(int fd)
-{
-	if (ioctl(fd, UI_DEV_DESTROY) == -1)
-		fprintf(stderr, "Error %s (%d) %s(): destroy virtual device\n", __FILE__, __LINE__, __FUNCTION__);
-	close(fd);
+	if (entry > 0) {
+		if (config->layer_oneshot) {
+			config->layer_oneshot = 0;
+			vd_config_layer_select(config, config->layer_base);
+		}
+		return entry;
+	}
+
+	if (entry < 0) {
+		layer = VD_LAYER_INDEX(entry);
+		switch (VD_LAYER_MODE(entry)) {
+		case VD_LAYER_MOMENTARY:
+			// held while the remote repeats the scancode
+			hold = config->hold_timeout ? config->hold_timeout : VD_HOLD_TIMEOUT;
+			config->layer_hold.tv_sec = hold / 1000;
+			config->layer_hold.tv_usec = (hold % 1000) * 1000;
+			timeradd(time, &config->layer_hold, &config->layer_hold);
+			config->layer_momentary = 1;
+			config->layer_oneshot = 0;
+			vd_config_layer_select(config, layer);
+			break;
+		case VD_LAYER_TOGGLE:
+			config->layer_base = config->layer_base == layer ? 0 : layer;
+			config->layer_momentary = 0;
+			config->layer_oneshot = 0;
+			vd_config_layer_select(config, config->layer_base);
+			break;
+		case VD_LAYER_ONESHOT:
+			config->layer_momentary = 0;
+			config->layer_oneshot = 1;
+			vd_config_layer_select(config, layer);
+			break;
+		}
+		return -1;
+	}
+	return 0;
 }
 
 /*
-* virtual_device_input_event
+* virtual_device_text
 */
-static volatile sig_atomic_t stop = 0;
+static const char * const vd_text_letters[10] = {" ", ".,", "abc", "def", "ghi", "jkl", "mno", "pqrs", "tuv", "wxyz"};
 
-static void interrupt_handler(int sig)
+// 2..9 for a letter, 0 - not a letter
+static int vd_text_digit(int c)
 {
-	stop = 1;
+	int d;
+
+	for (d = 2; d <= 9; d++)
+		if (strchr(vd_text_letters[d], c) != NULL)
+			return d;
+	return 0;
 }
 
-int test_grab(int fd, int grab_flag)
+// keycode of a letter, space, dot or comma, 0 - none
+static int vd_text_keycode(int c)
 {
-	int rc;
-
-	rc = ioctl(fd, EVIOCGRAB, (void*)1);
-
-	if (rc == 0 && !grab_flag)
-		ioctl(fd, EVIOCGRAB, (void*)0);
+	static int codes[128];
+	char name[] = "KEY_A";
 
-	return rc;
+	if (codes['a'] == 0) {
+		for (; name[4] <= 'Z'; name[4]++)
+			codes[name[4] | 0x20] = get_input_code(name);
+		codes[' '] = KEY_SPACE;
+		codes['.'] = KEY_DOT;
+		codes[','] = KEY_COMMA;
+	}
+	return c > 0 && c < 128 ? codes[c] : 0;
 }
 
-int input_event_open(const char *phys)
+// every child, word and string range inside the mapping, 0 - valid
+static int vd_text_check(const struct vd_dict_header *dict, size_t size)
 {
-	int fd;
+	const struct vd_dict_node *nodes;
+	const unsigned int *words;
+	const char *strings;
+	unsigned int i;
 
-	if ((fd = open(phys, O_RDONLY)) < 0) {
-		fprintf(stderr, "Error %s (%d) %s(): open input device %s\n", __FILE__, __LINE__, __FUNCTION__, phys);
+	if (size < sizeof(struct vd_dict_header) || memcmp(dict->magic, VD_DICT_MAGIC, 8) != 0
+		|| size != sizeof(struct vd_dict_header) + (size_t)dict->node_count * sizeof(struct vd_dict_node)
+			+ (size_t)dict->word_count * sizeof(unsigned int) + dict->strings_size)
+		return -1;
+	nodes = (const struct vd_dict_node *)(dict + 1);
+	words = (const unsigned int *)(nodes + dict->node_count);
+	strings = (const char *)(words + dict->word_count);
+
+	for (i = 0; i < dict->node_count; i++)
+		if ((unsigned long long)nodes[i].first_child + nodes[i].child_count > dict->node_count
+			|| (unsigned long long)nodes[i].words + nodes[i].word_count > dict->word_count)
+			return -1;
+	// a terminated last string keeps every offset below strings_size a C string
+	if (dict->word_count && (dict->strings_size == 0 || strings[dict->strings_size - 1] != 0))
+		return -1;
+	for (i = 0; i < dict->word_count; i++)
+		if (words[i] >= dict->strings_size)
+			return -1;
+	return 0;
+}
+
+int vd_text_open(struct vd_text *text)
+{
+	struct stat st;
+	void *map;
+	const struct vd_dict_header *dict;
+	int fd;
+
+	if (text->dict_path == NULL)
+		return 0;
+
+	if ((fd = open(text->dict_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): open dictionary %s\n", __FILE__, __LINE__, __FUNCTION__, text->dict_path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Error %s (%d) %s(): mmap dictionary %s\n", __FILE__, __LINE__, __FUNCTION__, text->dict_path);
+		return -1;
+	}
+
+	dict = map;
+	if (vd_text_check(dict, st.st_size) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): bad dictionary %s\n", __FILE__, __LINE__, __FUNCTION__, text->dict_path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	text->dict = dict;
+	text->dict_size = st.st_size;
+	return 0;
+}
+
+// candidate of the digit sequence, index wraps around, NULL - no word
+const char *vd_text_candidate(const struct vd_text *text, const char *digits, int length, int index, int *count)
+{
+	const struct vd_dict_node *nodes, *node;
+	const unsigned int *words;
+	const char *strings;
+	unsigned int i, n;
+
+	*count = 0;
+	if (text->dict == NULL || text->dict->node_count == 0)
+		return NULL;
+	nodes = (const struct vd_dict_node *)(text->dict + 1);
+	words = (const unsigned int *)(nodes + text->dict->node_count);
+	strings = (const char *)(words + text->dict->word_count);
+
+	node = &nodes[0];
+	while (length--) {
+		for (i = node->first_child, n = 0; n < node->child_count; i++, n++)
+			if (nodes[i].digit == *digits)
+				break;
+		if (n == node->child_count)
+			return NULL;
+		node = &nodes[i];
+		digits++;
+	}
+	if ((*count = node->word_count) == 0)
+		return NULL;
+	return strings + words[node->words + index % node->word_count];
+}
+
+struct vd_dict_build_node {
+	struct vd_dict_build_node *child[8];
+	unsigned int *words;
+	unsigned int word_count;
+	unsigned char digit;
+};
+
+// words file: one word per line, best first, anything after the word is ignored
+int vd_text_build(const char *words_path, const char *dict_path)
+{
+	struct vd_dict_header header;
+	struct vd_dict_node out;
+	struct vd_dict_build_node root, *node, **queue = NULL;
+	FILE *fin, *fout;
+	char line[LINE_LEN], *word, *strings = NULL;
+	unsigned int strings_size = 0, word_total = 0, count = 1, head, i, d, first, w;
+	int ret = -1;
+
+	if ((fin = fopen(words_path, "r")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): open %s\n", __FILE__, __LINE__, __FUNCTION__, words_path);
+		return -1;
+	}
+
+	memset(&root, 0, sizeof(root));
+	while (fgets(line, sizeof(line), fin) != NULL) {
+		if ((word = strtok(line, " \t\r\n")) == NULL || strlen(word) >= VD_TEXT_WORD_MAX)
+			continue;
+		for (i = 0; word[i]; i++)
+			if (!vd_text_digit(word[i] |= 0x20))
+				break;
+		if (word[i])
+			continue;
+
+		for (node = &root, i = 0; word[i]; i++) {
+			d = vd_text_digit(word[i]) - 2;
+			if (node->child[d] == NULL) {
+				if ((node->child[d] = calloc(1, sizeof(struct vd_dict_build_node))) == NULL)
+					goto out;
+				node->child[d]->digit = d + 2;
+				count++;
+			}
+			node = node->child[d];
+		}
+		if ((node->words = realloc(node->words, (node->word_count + 1) * sizeof(unsigned int))) == NULL
+			|| (strings = realloc(strings, strings_size + i + 1)) == NULL)
+			goto out;
+		node->words[node->word_count++] = strings_size;
+		memcpy(strings + strings_size, word, i + 1);
+		strings_size += i + 1;
+		word_total++;
+	}
+
+	// breadth-first, so the children of a node are next to each other
+	if ((queue = malloc(count * sizeof(*queue))) == NULL)
+		goto out;
+	queue[0] = &root;
+	for (head = 0, count = 1; head < count; head++)
+		for (d = 0; d < 8; d++)
+			if (queue[head]->child[d] != NULL)
+				queue[count++] = queue[head]->child[d];
+
+	if ((fout = fopen(dict_path, "w")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): open %s\n", __FILE__, __LINE__, __FUNCTION__, dict_path);
+		goto out;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VD_DICT_MAGIC, 8);
+	header.node_count = count;
+	header.word_count = word_total;
+	header.strings_size = strings_size;
+	fwrite(&header, sizeof(header), 1, fout);
+
+	for (i = 0, first = 1, w = 0; i < count; i++) {
+		memset(&out, 0, sizeof(out));
+		out.first_child = first;
+		out.words = w;
+		out.word_count = queue[i]->word_count > 0xFFFF ? 0xFFFF : queue[i]->word_count;
+		out.digit = queue[i]->digit;
+		for (d = 0; d < 8; d++)
+			if (queue[i]->child[d] != NULL)
+				out.child_count++;
+		first += out.child_count;
+		w += queue[i]->word_count;
+		fwrite(&out, sizeof(out), 1, fout);
+	}
+	for (i = 0; i < count; i++)
+		fwrite(queue[i]->words, sizeof(unsigned int), queue[i]->word_count, fout);
+	fwrite(strings, 1, strings_size, fout);
+
+	if (fclose(fout) == 0) {
+		fprintf(stdout, "%u words, %u nodes written to %s\n", word_total, count, dict_path);
+		ret = 0;
+	}
+out:
+	if (ret < 0)
+		fprintf(stderr, "Error %s (%d) %s(): build dictionary %s failed\n", __FILE__, __LINE__, __FUNCTION__, dict_path);
+	fclose(fin);
+	for (i = 0; queue != NULL && i < count; i++) {
+		free(queue[i]->words);
+		if (i > 0)
+			free(queue[i]);
+	}
+	free(queue);
+	free(strings);
+	return ret;
+}
+
+/*
+* virtual_device
+*/
+#ifndef VD_UINPUT_PATH
+#define VD_UINPUT_PATH "/dev/uinput"
+#endif
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NBITS(x) ((((x) - 1) / BITS_PER_LONG) + 1)
+#define TEST_BIT(bit, array) ((array[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+// capabilities of the input device for passthrough, EV_REP is left out
+// because repeats are forwarded as they come
+static int vd_copy_bits(int fd, int input_fd, struct uinput_user_dev *vd_uinput)
+{
+	static const struct {
+		int type, max;
+		unsigned long request;
+	} types[] = {
+		{EV_KEY, KEY_MAX, UI_SET_KEYBIT},
+		{EV_REL, REL_MAX, UI_SET_RELBIT},
+		{EV_ABS, ABS_MAX, UI_SET_ABSBIT},
+		{EV_MSC, MSC_MAX, UI_SET_MSCBIT},
+		{EV_SW, SW_MAX, UI_SET_SWBIT},
+	};
+	unsigned long evbit[NBITS(EV_MAX + 1)], bits[NBITS(KEY_MAX + 1)];
+	struct input_absinfo abs;
+	unsigned int i;
+	int code;
+
+	memset(evbit, 0, sizeof(evbit));
+	if (ioctl(input_fd, EVIOCGBIT(0, sizeof(evbit)), evbit) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, EVIOCGBIT(0))\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (!TEST_BIT(types[i].type, evbit))
+			continue;
+		memset(bits, 0, sizeof(bits));
+		if (ioctl(input_fd, EVIOCGBIT(types[i].type, sizeof(bits)), bits) < 0
+			|| ioctl(fd, UI_SET_EVBIT, types[i].type) == -1) {
+			fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_EVBIT, %d)\n", __FILE__, __LINE__, __FUNCTION__, types[i].type);
+			return -1;
+		}
+		for (code = 0; code <= types[i].max; code++) {
+			if (!TEST_BIT(code, bits))
+				continue;
+			if (ioctl(fd, types[i].request, code) == -1) {
+				fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, %lu, %d)\n", __FILE__, __LINE__, __FUNCTION__, types[i].request, code);
+				return -1;
+			}
+			if (types[i].type == EV_ABS && ioctl(input_fd, EVIOCGABS(code), &abs) == 0) {
+				vd_uinput->absmin[code] = abs.minimum;
+				vd_uinput->absmax[code] = abs.maximum;
+				vd_uinput->absfuzz[code] = abs.fuzz;
+				vd_uinput->absflat[code] = abs.flat;
+			}
+		}
+	}
+	return 0;
+}
+
+// also register everything the input devices can emit, for passthrough
+int vd_create(struct vd_config *config, const int *input_fds, int count)
+{
+	int fd, keycode, i;
+#ifndef VD_GENERATED_KEYMAP
+	struct vk_node *node;
+	const char *name;
+#endif
+	struct uinput_user_dev vd_uinput;
+
+	memset(&vd_uinput, 0, sizeof(struct uinput_user_dev));
+
+	if ((fd = open(VD_UINPUT_PATH, O_WRONLY | O_NONBLOCK)) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): could not open %s\n", __FILE__, __LINE__, __FUNCTION__, VD_UINPUT_PATH);
+		return -1;
+	}
+
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY) == -1) {
+		fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_EVBIT, EV_KEY)\n", __FILE__, __LINE__, __FUNCTION__);
+		close(fd);
+		return -1;
+	}
+
+	if (ioctl(fd, UI_SET_EVBIT, EV_SYN) == -1) {
+		fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_EVBIT, EV_SYN)\n", __FILE__, __LINE__, __FUNCTION__);
+		close(fd);
+		return -1;
+	}
+
+#ifdef VD_GENERATED_KEYMAP
+	for (keycode = 0; keycode < KEY_CNT; keycode++) {
+		if (((vd_generated_keybits[keycode >> 3] >> (keycode & 7)) & 1) && ioctl(fd, UI_SET_KEYBIT, keycode) == -1) {
+			fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_KEYBIT, %d)\n", __FILE__, __LINE__, __FUNCTION__, keycode);
+			close(fd);
+			return -1;
+		}
+	}
+#else
+	node = config->vks;
+	while (node != NULL)
+	{
+		if (vd_layer_mode(node->key, &name) != 0) {
+			// layer switch
+		} else if ((keycode = get_input_code(node->key)) != -1) {
+			if (ioctl(fd, UI_SET_KEYBIT, keycode) == -1) {
+				fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_KEYBIT, %d)\n", __FILE__, __LINE__, __FUNCTION__, keycode);
+				close(fd);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "Error %s (%d) %s(): unknown key name %s, %d\n", __FILE__, __LINE__, __FUNCTION__, node->key, node->scancode);
+		}
+		node = node->next;
+	}
+
+	for (keycode = 0; config->remap != NULL && keycode < KEY_CNT; keycode++) {
+		if (config->remap[keycode].code && (ioctl(fd, UI_SET_KEYBIT, config->remap[keycode].code) == -1
+			|| (config->remap[keycode].modifier && ioctl(fd, UI_SET_KEYBIT, config->remap[keycode].modifier) == -1))) {
+			fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_KEYBIT, %d)\n", __FILE__, __LINE__, __FUNCTION__, config->remap[keycode].code);
+			close(fd);
+			return -1;
+		}
+	}
+
+	// letters of the text entry
+	for (keycode = 0; config->text != NULL && keycode < 128; keycode++) {
+		if (vd_text_keycode(keycode) > 0 && ioctl(fd, UI_SET_KEYBIT, vd_text_keycode(keycode)) == -1) {
+			fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_SET_KEYBIT, %d)\n", __FILE__, __LINE__, __FUNCTION__, vd_text_keycode(keycode));
+			close(fd);
+			return -1;
+		}
+	}
+	if (config->text != NULL)
+		ioctl(fd, UI_SET_KEYBIT, KEY_BACKSPACE);
+#endif
+
+	for (i = 0; i < count; i++) {
+		if (vd_copy_bits(fd, input_fds[i], &vd_uinput) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	strncpy(vd_uinput.name, config->name, UINPUT_MAX_NAME_SIZE);
+	vd_uinput.id.bustype	= BUS_USB;
+	vd_uinput.id.vendor		= 0x99a; /* dummy vendor */
+	vd_uinput.id.product	= 0x7501; /* dummy product */
+	vd_uinput.id.version	= 0x100;
+	//if (config->phys != NULL)
+	//	vd_uinput.id.phys = "sunxi_ir_keyboard/input0";
+
+	if (write(fd, &vd_uinput, sizeof(vd_uinput)) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): setup virtual device\n", __FILE__, __LINE__, __FUNCTION__);
+		close(fd);
+		return -1;
+	}
+
+	if (ioctl(fd, UI_DEV_CREATE) == -1) {
+		fprintf(stderr, "Error %s (%d) %s(): create virtual device\n", __FILE__, __LINE__, __FUNCTION__);
+		close(fd);
+		return -1;
+	}
+
+	sleep(1);
+
+	return fd;
+}
+
+void vd_send_event(int fd, int type, int code, int value)//, long tv_sec, long tv_usec)
+{
+	struct input_event ev;
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	//ev.time.tv_sec = 0;
+	//ev.time.tv_usec = 0;
+	VD_TRACE(VD_TRACE_EMIT, emit, type, code, value);
+	if (write(fd, &ev, sizeof(ev)) < 0)
+		fprintf(stderr, "Error %s (%d) %s(): write()\n", __FILE__, __LINE__, __FUNCTION__);
+	VD_TRACE(VD_TRACE_WRITE, write, type, code, value);
+}
+
+// events as they are, one write()
+void vd_send_events(int fd, const struct input_event *ev, int count)
+{
+	if (count <= 0)
+		return;
+	VD_TRACE(VD_TRACE_EMIT, emit, ev->type, ev->code, count);
+	if (write(fd, ev, count * sizeof(struct input_event)) < 0)
+		fprintf(stderr, "Error %s (%d) %s(): write()\n", __FILE__, __LINE__, __FUNCTION__);
+	VD_TRACE(VD_TRACE_WRITE, write, ev->type, ev->code, count);
+}
+
+int vd_output_init(struct vd_output *out, int fd, unsigned int bound)
+{
+	memset(out, 0, sizeof(struct vd_output));
+	out->fd = fd;
+	out->bound = bound ? bound : VD_OUTPUT_QUEUE;
+	if (out->bound > VD_OUTPUT_QUEUE_MAX)
+		out->bound = VD_OUTPUT_QUEUE_MAX;
+	out->size = out->bound + VD_OUTPUT_RESERVE;
+	if ((out->queue = malloc(out->size * sizeof(struct input_event))) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+static int vd_output_push(struct vd_output *out, const struct input_event *ev)
+{
+	if (out->count == out->size) {
+		out->dropped++;
+		return 0;
+	}
+	out->queue[(out->head + out->count++) % out->size] = *ev;
+	if (out->count > out->max_count)
+		out->max_count = out->count;
+	return 1;
+}
+
+// with nothing queued and no dropped key held the batch is written as it is,
+// only the part the device did not take is queued
+static int vd_output_direct(struct vd_output *out, const struct input_event *ev, int count)
+{
+	unsigned char bit;
+	ssize_t ret;
+	int i;
+
+	VD_TRACE(VD_TRACE_EMIT, emit, ev->type, ev->code, count);
+	while ((ret = write(out->fd, ev, count * sizeof(struct input_event))) < 0 && errno == EINTR)
+		;
+	if (ret <= 0)
+		return 0;
+	VD_TRACE(VD_TRACE_WRITE, write, ev->type, ev->code, ret);
+	ret /= sizeof(struct input_event);
+	// keys that went down need room in the reserve for their release
+	for (i = 0; i < ret; i++) {
+		if (ev[i].type != EV_KEY || ev[i].code >= KEY_CNT || ev[i].value == 2)
+			continue;
+		bit = 1 << (ev[i].code & 7);
+		if (ev[i].value)
+			out->down_keys[ev[i].code >> 3] |= bit;
+		else
+			out->down_keys[ev[i].code >> 3] &= ~bit;
+	}
+	return ret;
+}
+
+// whole frames are queued while under the bound, over it presses are dropped with
+// their repeats and release, and releases of queued presses go to the reserve, which
+// holds one for every key, so a key that went down always comes up
+void vd_output_write(struct vd_output *out, const struct input_event *ev, int count)
+{
+	unsigned char bit, *down;
+	int i, frame, over, kept, dropped;
+
+	frame = out->count == 0 && out->dropped_held == 0 && count > 0 ? vd_output_direct(out, ev, count) : 0;
+	for (; frame < count; frame = i + 1) {
+		for (i = frame; i < count - 1; i++)
+			if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT)
+				break;
+		// the device may have room already
+		if (out->count + (i + 1 - frame) > out->bound)
+			vd_output_flush(out);
+		over = out->count + (i + 1 - frame) > out->bound;
+		kept = dropped = 0;
+		for (; frame <= i; frame++) {
+			if (ev[frame].type == EV_SYN && ev[frame].code == SYN_REPORT) {
+				// a frame with everything dropped is not reported
+				if (kept || (!dropped && !over))
+					vd_output_push(out, &ev[frame]);
+				continue;
+			}
+			if (ev[frame].type == EV_KEY && ev[frame].code < KEY_CNT) {
+				bit = 1 << (ev[frame].code & 7);
+				down = &out->down_keys[ev[frame].code >> 3];
+				if (out->dropped_keys[ev[frame].code >> 3] & bit) {
+					if (ev[frame].value == 0) {
+						out->dropped_keys[ev[frame].code >> 3] &= ~bit;
+						out->dropped_held--;
+					}
+					out->dropped++;
+					dropped++;
+					continue;
+				}
+				if (over && ev[frame].value == 1) {
+					out->dropped_keys[ev[frame].code >> 3] |= bit;
+					out->dropped_held++;
+				}
+				// the reserve only has room for releases of keys that are down
+				if (over && (ev[frame].value != 0 || !(*down & bit))) {
+					out->dropped++;
+					dropped++;
+					continue;
+				}
+				if (ev[frame].value == 1)
+					*down |= bit;
+				else if (ev[frame].value == 0)
+					*down &= ~bit;
+			} else if (over) {
+				out->dropped++;
+				dropped++;
+				continue;
+			}
+			kept += vd_output_push(out, &ev[frame]);
+		}
+	}
+}
+
+// as much of the queue as the device takes, -1 - write error
+int vd_output_flush(struct vd_output *out)
+{
+	unsigned int n;
+	ssize_t ret;
+
+	while (out->count) {
+		n = out->size - out->head;
+		if (n > out->count)
+			n = out->count;
+		VD_TRACE(VD_TRACE_EMIT, emit, out->queue[out->head].type, out->queue[out->head].code, n);
+		if ((ret = write(out->fd, &out->queue[out->head], n * sizeof(struct input_event))) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			fprintf(stderr, "Error %s (%d) %s(): write()\n", __FILE__, __LINE__, __FUNCTION__);
+			return -1;
+		}
+		VD_TRACE(VD_TRACE_WRITE, write, out->queue[out->head].type, out->queue[out->head].code, ret);
+		ret /= sizeof(struct input_event);
+		out->head = (out->head + ret) % out->size;
+		out->count -= ret;
+		if (ret < n)
+			return 0;
+	}
+	return 0;
+}
+
+void vd_output_free(struct vd_output *out)
+{
+	free(out->queue);
+	out->queue = NULL;
+	out->count = 0;
+}
+
+void vd_destroy(int fd)
+{
+	if (ioctl(fd, UI_DEV_DESTROY) == -1)
+		fprintf(stderr, "Error %s (%d) %s(): destroy virtual device\n", __FILE__, __LINE__, __FUNCTION__);
+	close(fd);
+}
+
+/*
+* virtual_device_emit
+*/
+static void vd_emit_string(FILE *fout, const char *string)
+{
+	fputc('"', fout);
+	for (; *string; string++) {
+		if (*string == '"' || *string == '\\')
+			fputc('\\', fout);
+		fputc(*string, fout);
+	}
+	fputc('"', fout);
+}
+
+static void vd_emit_entry(FILE *fout, unsigned int scancode, int entry)
+{
+	if (entry > 0)
+		fprintf(fout, "\tcase 0x%08X: return %d; /* %s */\n", scancode, entry, get_input_name(entry));
+	else
+		fprintf(fout, "\tcase 0x%08X: return %d;\n", scancode, entry);
+}
+
+static void vd_emit_bit(unsigned char *bits, int code)
+{
+	if (code > 0 && code < KEY_CNT)
+		bits[code >> 3] |= 1 << (code & 7);
+}
+
+// the built tables as C for -DVD_GENERATED_KEYMAP, a switch per layer and the config
+int vd_config_emit(const char *filename, struct vd_config *config)
+{
+	FILE *fout;
+	struct vk_node *node;
+	unsigned char bits[(KEY_CNT + 7) / 8];
+	unsigned int i, j, n;
+	int entry;
+
+	if (config->table == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): no keys table\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	if ((fout = fopen(filename, "w")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): emit keymap to %s failed.\n", __FILE__, __LINE__, __FUNCTION__, filename);
+		return -1;
+	}
+
+	fprintf(fout, "/* generated by virtual_input --emit-c, do not edit */\n\n");
+
+	// every key the virtual device emits
+	memset(bits, 0, sizeof(bits));
+	for (i = 0; i < config->layer_count; i++)
+		for (j = 0; j <= config->max - config->min; j++)
+			vd_emit_bit(bits, config->layers[i].table[j]);
+	for (i = 0; config->remap != NULL && i < KEY_CNT; i++) {
+		vd_emit_bit(bits, config->remap[i].code);
+		vd_emit_bit(bits, config->remap[i].modifier);
+	}
+	for (i = 0; config->text != NULL && i < 128; i++)
+		vd_emit_bit(bits, vd_text_keycode(i));
+	if (config->text != NULL)
+		vd_emit_bit(bits, KEY_BACKSPACE);
+	fprintf(fout, "static const unsigned char vd_generated_keybits[(KEY_CNT + 7) / 8] = {");
+	for (i = 0; i < sizeof(bits); i++)
+		fprintf(fout, "%s0x%02X,", i % 12 ? " " : "\n\t", bits[i]);
+	fprintf(fout, "\n};\n\n");
+
+	// layers only list the entries they change
+	fprintf(fout, "static inline int vd_generated_lookup(unsigned int layer, unsigned int scancode)\n{\n");
+	if (config->layer_count > 1) {
+		fprintf(fout, "\tswitch (layer) {\n");
+		for (i = 1; i < config->layer_count; i++) {
+			fprintf(fout, "\tcase %u: /* %s */\n\t\tswitch (scancode) {\n", i, config->layers[i].name);
+			for (j = 0; j <= config->max - config->min; j++)
+				if ((entry = config->layers[i].table[j]) != config->layers[0].table[j]) {
+					fputs("\t", fout);
+					vd_emit_entry(fout, config->min + j, entry);
+				}
+			fprintf(fout, "\t\t}\n\t\tbreak;\n");
+		}
+		fprintf(fout, "\t}\n");
+	}
+	fprintf(fout, "\tswitch (scancode) {\n");
+	for (j = 0; j <= config->max - config->min; j++)
+		if ((entry = config->layers[0].table[j]) != 0)
+			vd_emit_entry(fout, config->min + j, entry);
+	fprintf(fout, "\tdefault: return 0;\n\t}\n}\n\n");
+
+	// key nodes for the stages that walk them
+	n = 0;
+	for (node = config->vks; node != NULL; node = node->next)
+		n++;
+	fprintf(fout, "static struct vk_node vd_generated_vks[%u] = {\n", n);
+	for (i = 0, node = config->vks; node != NULL; node = node->next, i++) {
+		fprintf(fout, "\t{(char *)");
+		vd_emit_string(fout, node->key);
+		if (node->next != NULL)
+			fprintf(fout, ", 0x%08X, %d, vd_generated_vks + %u, ", node->scancode, node->layer, i + 1);
+		else
+			fprintf(fout, ", 0x%08X, %d, NULL, ", node->scancode, node->layer);
+		if (node->kodi != NULL) {
+			fprintf(fout, "(char *)");
+			vd_emit_string(fout, node->kodi);
+		} else {
+			fprintf(fout, "NULL");
+		}
+		fprintf(fout, "},\n");
+	}
+	fprintf(fout, "};\n\n");
+
+	fprintf(fout, "static struct vd_layer vd_generated_layers[%u] = {\n", config->layer_count);
+	for (i = 0; i < config->layer_count; i++) {
+		fprintf(fout, "\t{(char *)");
+		vd_emit_string(fout, config->layers[i].name);
+		fprintf(fout, ", NULL},\n");
+	}
+	fprintf(fout, "};\n\n");
+
+	if (config->remap != NULL) {
+		fprintf(fout, "static struct vd_remap vd_generated_remap[KEY_CNT] = {\n");
+		for (i = 0; i < KEY_CNT; i++)
+			if (config->remap[i].code)
+				fprintf(fout, "\t[%u] = {%u, %u}, /* %s */\n", i, config->remap[i].code, config->remap[i].modifier, get_input_name(i));
+		fprintf(fout, "};\n\n");
+	}
+
+	if (config->text != NULL) {
+		fprintf(fout, "static struct vd_text vd_generated_text = {\n");
+		fprintf(fout, "\t.mode = %d,\n", config->text->mode);
+		if (config->text->dict_path != NULL) {
+			fprintf(fout, "\t.dict_path = (char *)");
+			vd_emit_string(fout, config->text->dict_path);
+			fprintf(fout, ",\n");
+		}
+		fprintf(fout, "\t.toggle = %d,\n\t.next = %d,\n\t.timeout = %u,\n\t.last_digit = -1,\n};\n\n",
+				config->text->toggle, config->text->next, config->text->timeout);
+	}
+
+	if (config->sequence_count) {
+		fprintf(fout, "static struct vd_sequence vd_generated_sequences[%u] = {\n", config->sequence_count);
+		for (i = 0; i < config->sequence_count; i++) {
+			fprintf(fout, "\t{(char *)");
+			vd_emit_string(fout, config->sequences[i].action);
+			fprintf(fout, ", %u, %d, {", config->sequences[i].timeout, config->sequences[i].length);
+			for (j = 0; j < (unsigned int)config->sequences[i].length; j++) {
+				fprintf(fout, "%s(char *)", j ? ", " : "");
+				vd_emit_string(fout, config->sequences[i].keys[j]);
+			}
+			fprintf(fout, "}},\n");
+		}
+		fprintf(fout, "};\n\n");
+	}
+
+	fprintf(fout, "static void vd_generated_config(struct vd_config *config)\n{\n");
+#define VD_EMIT_STRING(field) do { \
+	if (config->field != NULL) { \
+		fprintf(fout, "\tconfig->" #field " = (char *)"); \
+		vd_emit_string(fout, config->field); \
+		fprintf(fout, ";\n"); \
+	} \
+} while (0)
+#define VD_EMIT_UINT(field) fprintf(fout, "\tconfig->" #field " = %u;\n", (unsigned int)config->field)
+	VD_EMIT_STRING(name);
+	VD_EMIT_STRING(input);
+	VD_EMIT_STRING(input_cache);
+	VD_EMIT_STRING(trace);
+	VD_EMIT_STRING(publish);
+	VD_EMIT_STRING(kodi);
+	VD_EMIT_UINT(kodi_port);
+	VD_EMIT_UINT(trace_threshold);
+	VD_EMIT_UINT(publish_queue);
+	VD_EMIT_UINT(publish_policy);
+	VD_EMIT_UINT(passthrough);
+	VD_EMIT_UINT(hold_timeout);
+	VD_EMIT_UINT(correct);
+	VD_EMIT_UINT(output_queue);
+	// range of the scancodes, the sequence symbols are indexed by it
+	VD_EMIT_UINT(min);
+	VD_EMIT_UINT(max);
+	for (i = 0; i < config->merge_count; i++) {
+		fprintf(fout, "\tconfig->merge[%u] = (char *)", i);
+		vd_emit_string(fout, config->merge[i]);
+		fprintf(fout, ";\n");
+	}
+	VD_EMIT_UINT(merge_count);
+	VD_EMIT_UINT(merge_window);
+	for (i = 0; i < config->filter_count; i++)
+		fprintf(fout, "\tconfig->filters[%u] = %d; /* %s */\n", i, config->filters[i], vd_filter_names[config->filters[i]]);
+	VD_EMIT_UINT(filter_count);
+#undef VD_EMIT_UINT
+#undef VD_EMIT_STRING
+	fprintf(fout, "\tconfig->vks = %s;\n", n ? "vd_generated_vks" : "NULL");
+	fprintf(fout, "\tconfig->layers = vd_generated_layers;\n\tconfig->layer_count = %u;\n", config->layer_count);
+	if (config->remap != NULL)
+		fprintf(fout, "\tconfig->remap = vd_generated_remap;\n");
+	if (config->text != NULL)
+		fprintf(fout, "\tconfig->text = &vd_generated_text;\n");
+	if (config->sequence_count)
+		fprintf(fout, "\tconfig->sequences = vd_generated_sequences;\n\tconfig->sequence_count = %u;\n", config->sequence_count);
+	fprintf(fout, "}\n");
+
+	fflush(fout);
+	fclose(fout);
+	return 0;
+}
+
+/*
+* virtual_device_publish
+*/
+int vd_publish_open(struct vd_publish *pub, const char *path, unsigned int queue_size, int policy)
+{
+	struct sockaddr_un addr;
+
+	memset(pub, 0, sizeof(struct vd_publish));
+	pub->fd = -1;
+	pub->policy = policy;
+	pub->queue_size = queue_size ? queue_size : VD_PUBLISH_QUEUE;
+	if (pub->queue_size > VD_PUBLISH_QUEUE_MAX)
+		pub->queue_size = VD_PUBLISH_QUEUE_MAX;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error %s (%d) %s(): socket path too long %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// message boundaries keep batches of whole events, a full socket never blocks
+	if ((pub->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): socket()\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	unlink(path);
+	if (bind(pub->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(pub->fd, VD_PUBLISH_MAX) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): listen on %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		close(pub->fd);
+		pub->fd = -1;
+		return -1;
+	}
+	pub->path = strdup(path);
+	return 0;
+}
+
+static void vd_publish_drop(struct vd_publish *pub, unsigned int i)
+{
+	struct vd_subscriber *sub = &pub->subs[i];
+
+	if (sub->dropped)
+		fprintf(stderr, "Error %s (%d) %s(): subscriber %d dropped %lu events\n", __FILE__, __LINE__, __FUNCTION__, sub->fd, sub->dropped);
+	close(sub->fd);
+	free(sub->queue);
+	// keep the array dense
+	*sub = pub->subs[--pub->count];
+}
+
+static void vd_publish_accept(struct vd_publish *pub)
+{
+	struct vd_subscriber *sub;
+	int fd;
+
+	while ((fd = accept4(pub->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (pub->count == VD_PUBLISH_MAX) {
+			fprintf(stderr, "Error %s (%d) %s(): too many subscribers\n", __FILE__, __LINE__, __FUNCTION__);
+			close(fd);
+			continue;
+		}
+		sub = &pub->subs[pub->count];
+		memset(sub, 0, sizeof(struct vd_subscriber));
+		if ((sub->queue = malloc(pub->queue_size * sizeof(struct vd_publish_event))) == NULL) {
+			fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+			close(fd);
+			continue;
+		}
+		sub->fd = fd;
+		pub->count++;
+	}
+}
+
+void vd_publish_event(struct vd_publish *pub, const struct input_event *ev, int keycode, int value, int layer)
+{
+	struct vd_subscriber *sub;
+	struct vd_publish_event *rec;
+	unsigned int i;
+
+	for (i = 0; i < pub->count; i++) {
+		sub = &pub->subs[i];
+		if (sub->count == pub->queue_size) {
+			if (pub->policy == VD_PUBLISH_DISCONNECT) {
+				vd_publish_drop(pub, i--);
+				continue;
+			}
+			sub->head = (sub->head + 1) % pub->queue_size;
+			sub->count--;
+			sub->dropped++;
+		}
+		rec = &sub->queue[(sub->head + sub->count++) % pub->queue_size];
+		rec->time = (unsigned long long)ev->time.tv_sec * 1000000ULL + ev->time.tv_usec;
+		rec->scancode = ev->value;
+		rec->keycode = keycode;
+		rec->value = value;
+		rec->layer = layer;
+	}
+}
+
+// whole queue as one message, -1 - subscriber is gone
+static int vd_publish_send(struct vd_publish *pub, struct vd_subscriber *sub)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned int first;
+
+	first = pub->queue_size - sub->head;
+	if (first > sub->count)
+		first = sub->count;
+	iov[0].iov_base = &sub->queue[sub->head];
+	iov[0].iov_len = first * sizeof(struct vd_publish_event);
+	iov[1].iov_base = &sub->queue[0];
+	iov[1].iov_len = (sub->count - first) * sizeof(struct vd_publish_event);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = sub->count > first ? 2 : 1;
+	if (sendmsg(sub->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	sub->head = (sub->head + sub->count) % pub->queue_size;
+	sub->count = 0;
+	return 0;
+}
+
+// one write per subscriber for everything queued since the last wakeup
+void vd_publish_flush(struct vd_publish *pub)
+{
+	unsigned int i;
+
+	for (i = 0; i < pub->count; i++)
+		if (pub->subs[i].count && vd_publish_send(pub, &pub->subs[i]) < 0)
+			vd_publish_drop(pub, i--);
+}
+
+// listening socket first, then subscribers in order
+int vd_publish_pollfd(struct vd_publish *pub, struct pollfd *fds)
+{
+	unsigned int i;
+
+	if (pub->fd < 0)
+		return 0;
+
+	fds[0].fd = pub->fd;
+	fds[0].events = POLLIN;
+	for (i = 0; i < pub->count; i++) {
+		fds[i + 1].fd = pub->subs[i].fd;
+		fds[i + 1].events = pub->subs[i].count ? POLLIN | POLLOUT : POLLIN;
+	}
+	return pub->count + 1;
+}
+
+void vd_publish_poll(struct vd_publish *pub, struct pollfd *fds, int nfds)
+{
+	char buf[64];
+	int i;
+
+	if (nfds == 0)
+		return;
+
+	// subscribers do not talk, input only tells about hangup
+	for (i = nfds - 1; i > 0; i--) {
+		if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)
+			|| ((fds[i].revents & POLLIN) && recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT) == 0))
+			vd_publish_drop(pub, i - 1);
+	}
+
+	if (fds[0].revents & POLLIN)
+		vd_publish_accept(pub);
+
+	vd_publish_flush(pub);
+}
+
+void vd_publish_close(struct vd_publish *pub)
+{
+	while (pub->count)
+		vd_publish_drop(pub, 0);
+	if (pub->fd >= 0)
+		close(pub->fd);
+	pub->fd = -1;
+	if (pub->path != NULL)
+		unlink(pub->path);
+	free(pub->path);
+	pub->path = NULL;
+}
+
+/*
+* virtual_device_kodi
+*/
+#define VD_KODI_HEADER 32
+#define VD_KODI_PT_HELO 0x01
+#define VD_KODI_PT_BYE 0x02
+#define VD_KODI_PT_BUTTON 0x03
+#define VD_KODI_PT_PING 0x05
+#define VD_KODI_BT_USE_NAME 0x01
+#define VD_KODI_BT_DOWN 0x02
+#define VD_KODI_BT_QUEUE 0x10
+#define VD_KODI_BT_NO_REPEAT 0x20
+
+static unsigned char *vd_kodi_u16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static unsigned char *vd_kodi_u32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static unsigned int vd_kodi_get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+// big endian header of a single packet message
+static unsigned char *vd_kodi_header(unsigned char *p, int type, unsigned int token, unsigned int size)
+{
+	memcpy(p, "XBMC", 4);
+	p[4] = 2; // protocol 2.0
+	p[5] = 0;
+	p = vd_kodi_u16(p + 6, type);
+	p = vd_kodi_u32(p, 1); // sequence
+	p = vd_kodi_u32(p, 1); // packets in the message
+	p = vd_kodi_u16(p, size);
+	p = vd_kodi_u32(p, token);
+	memset(p, 0, 10);
+	return p + 10;
+}
+
+// BUTTON press by map and name, the EventServer does the keymap lookup
+static unsigned int vd_kodi_button(unsigned char *p, unsigned int token, const char *map, int map_len, const char *name)
+{
+	unsigned int size = 6 + map_len + 1 + strlen(name) + 1;
+
+	if (p == NULL)
+		return VD_KODI_HEADER + size;
+	p = vd_kodi_header(p, VD_KODI_PT_BUTTON, token, size);
+	p = vd_kodi_u16(p, 0);
+	p = vd_kodi_u16(p, VD_KODI_BT_USE_NAME | VD_KODI_BT_DOWN | VD_KODI_BT_QUEUE | VD_KODI_BT_NO_REPEAT);
+	p = vd_kodi_u16(p, 0);
+	memcpy(p, map, map_len);
+	p[map_len] = 0;
+	strcpy((char *)p + map_len + 1, name);
+	return VD_KODI_HEADER + size;
+}
+
+// "MAP:name", "" - keyboard map and the key name without KEY_ in lower case
+static unsigned int vd_kodi_template(unsigned char *p, unsigned int token, struct vk_node *node)
+{
+	char name[64];
+	const char *sep;
+	int i;
+
+	if ((sep = strchr(node->kodi, ':')) != NULL)
+		return vd_kodi_button(p, token, node->kodi, sep - node->kodi, sep + 1);
+	for (i = 0; node->key[i + 4] && i < (int)sizeof(name) - 1; i++)
+		name[i] = tolower((unsigned char)node->key[i + 4]);
+	name[i] = 0;
+	return vd_kodi_button(p, token, "KB", 2, name);
+}
+
+static void vd_kodi_send_one(struct vd_kodi *kodi, const unsigned char *packet, unsigned int length)
+{
+	if (send(kodi->fd, packet, length, MSG_DONTWAIT) < 0)
+		kodi->errors++;
+}
+
+static void vd_kodi_due(struct vd_kodi *kodi, unsigned int seconds)
+{
+	clock_gettime(CLOCK_MONOTONIC, &kodi->ping);
+	kodi->ping.tv_sec += seconds;
+}
+
+static int vd_kodi_key_cmp(const void *a, const void *b)
+{
+	const struct vd_kodi_key *x = a, *y = b;
+
+	if (x->scancode != y->scancode)
+		return x->scancode < y->scancode ? -1 : 1;
+	return x->layer < y->layer ? -1 : x->layer > y->layer;
+}
+
+// resolve the host and say HELO, at boot the network may not be up yet, 0 - connected
+static int vd_kodi_connect(struct vd_kodi *kodi)
+{
+	struct addrinfo hints, *addr;
+	char port[16];
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(port, sizeof(port), "%u", kodi->port);
+	if ((ret = getaddrinfo(kodi->host, port, &hints, &addr)) != 0) {
+		if (kodi->retries++ == 0)
+			fprintf(stderr, "Error %s (%d) %s(): kodi host %s, %s, retrying every %d s\n", __FILE__, __LINE__, __FUNCTION__, kodi->host, gai_strerror(ret), VD_KODI_RETRY);
+		vd_kodi_due(kodi, VD_KODI_RETRY);
+		return -1;
+	}
+	if ((kodi->fd = socket(addr->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+		|| connect(kodi->fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+		if (kodi->retries++ == 0)
+			fprintf(stderr, "Error %s (%d) %s(): kodi socket %s:%s, retrying every %d s\n", __FILE__, __LINE__, __FUNCTION__, kodi->host, port, VD_KODI_RETRY);
+		if (kodi->fd >= 0)
+			close(kodi->fd);
+		kodi->fd = -1;
+		freeaddrinfo(addr);
+		vd_kodi_due(kodi, VD_KODI_RETRY);
+		return -1;
+	}
+	freeaddrinfo(addr);
+	if (kodi->retries)
+		fprintf(stdout, "Kodi %s:%s\n", kodi->host, port);
+	kodi->retries = 0;
+
+	vd_kodi_send_one(kodi, kodi->packets, kodi->helo_length);
+	vd_kodi_due(kodi, VD_KODI_PING);
+	return 0;
+}
+
+// the keys of other layers on the same scancode are kept too, they shadow a Kodi key of the base layer
+int vd_kodi_open(struct vd_kodi *kodi, struct vd_config *config)
+{
+	struct vk_node *node;
+	unsigned char *p;
+	unsigned int i;
+
+	memset(kodi, 0, sizeof(struct vd_kodi));
+	kodi->fd = -1;
+	kodi->token = getpid();
+	kodi->host = config->kodi;
+	kodi->port = config->kodi_port ? config->kodi_port : VD_KODI_PORT;
+
+	for (node = config->vks; node != NULL; node = node->next)
+		if (node->kodi != NULL || node->layer != 0)
+			kodi->key_count++;
+	if ((kodi->keys = calloc(kodi->key_count + 1, sizeof(struct vd_kodi_key))) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	// HELO with the device name, no icon, then PING, then a BUTTON per key
+	kodi->helo_length = VD_KODI_HEADER + strlen(config->name) + 1 + 11;
+	kodi->size = kodi->helo_length + VD_KODI_HEADER;
+	for (node = config->vks, i = 0; node != NULL; node = node->next) {
+		if (node->kodi == NULL && node->layer == 0)
+			continue;
+		kodi->keys[i].scancode = node->scancode;
+		kodi->keys[i].layer = node->layer;
+		if (node->kodi != NULL && get_input_code(node->key) > 0) {
+			kodi->keys[i].offset = kodi->size;
+			kodi->keys[i].length = vd_kodi_template(NULL, 0, node);
+			kodi->size += kodi->keys[i].length;
+		}
+		i++;
+	}
+	if ((kodi->packets = malloc(kodi->size)) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		vd_kodi_close(kodi);
+		return -1;
+	}
+
+	p = vd_kodi_header(kodi->packets, VD_KODI_PT_HELO, kodi->token, kodi->helo_length - VD_KODI_HEADER);
+	strcpy((char *)p, config->name);
+	memset(p + strlen(config->name) + 1, 0, 11);
+	vd_kodi_header(kodi->packets + kodi->helo_length, VD_KODI_PT_PING, kodi->token, 0);
+	for (node = config->vks, i = 0; node != NULL; node = node->next) {
+		if (node->kodi == NULL && node->layer == 0)
+			continue;
+		if (kodi->keys[i].length)
+			vd_kodi_template(kodi->packets + kodi->keys[i].offset, kodi->token, node);
+		i++;
+	}
+	qsort(kodi->keys, kodi->key_count, sizeof(struct vd_kodi_key), vd_kodi_key_cmp);
+
+	vd_kodi_connect(kodi);
+	return 0;
+}
+
+// Kodi key of the scancode in the layer it was looked up in, a layer without
+// the scancode falls back to the base layer, -1 - the key goes to uinput
+int vd_kodi_key(const struct vd_kodi *kodi, unsigned int layer, int scancode)
+{
+	struct vd_kodi_key key, *found;
+
+	key.scancode = scancode;
+	key.layer = layer;
+	if ((found = bsearch(&key, kodi->keys, kodi->key_count, sizeof(struct vd_kodi_key), vd_kodi_key_cmp)) == NULL && layer) {
+		key.layer = 0;
+		found = bsearch(&key, kodi->keys, kodi->key_count, sizeof(struct vd_kodi_key), vd_kodi_key_cmp);
+	}
+	return found != NULL && found->length ? found - kodi->keys : -1;
+}
+
+// BUTTON packets of the keys with one sendmmsg()
+void vd_kodi_send(struct vd_kodi *kodi, const unsigned int *keys, int count)
+{
+	struct mmsghdr msgs[VD_KODI_BATCH];
+	struct iovec iov[VD_KODI_BATCH];
+	int i, ret;
+
+	if (count > VD_KODI_BATCH)
+		count = VD_KODI_BATCH;
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = kodi->packets + kodi->keys[keys[i]].offset;
+		iov[i].iov_len = kodi->keys[keys[i]].length;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if ((ret = sendmmsg(kodi->fd, msgs, count, MSG_DONTWAIT)) < 0) {
+		kodi->errors += count;
+		// Kodi was not listening, it needs a HELO once it is back
+		if (errno == ECONNREFUSED)
+			vd_kodi_send_one(kodi, kodi->packets, kodi->helo_length);
+		return;
+	}
+	kodi->sent += ret;
+	kodi->errors += count - ret;
+}
+
+// ms until the next PING or lookup of the host
+int vd_kodi_timeout(struct vd_kodi *kodi)
+{
+	struct timespec now;
+	long long ms;
+
+	if (kodi->packets == NULL)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (kodi->ping.tv_sec - now.tv_sec) * 1000LL + (kodi->ping.tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+void vd_kodi_ping(struct vd_kodi *kodi)
+{
+	if (kodi->packets == NULL || vd_kodi_timeout(kodi) > 0)
+		return;
+	if (kodi->fd < 0) {
+		vd_kodi_connect(kodi);
+		return;
+	}
+	vd_kodi_send_one(kodi, kodi->packets + kodi->helo_length, VD_KODI_HEADER);
+	vd_kodi_due(kodi, VD_KODI_PING);
+}
+
+void vd_kodi_close(struct vd_kodi *kodi)
+{
+	unsigned char bye[VD_KODI_HEADER];
+
+	if (kodi->fd >= 0) {
+		if (kodi->packets != NULL) {
+			vd_kodi_header(bye, VD_KODI_PT_BYE, kodi->token, 0);
+			vd_kodi_send_one(kodi, bye, sizeof(bye));
+		}
+		close(kodi->fd);
+	}
+	free(kodi->packets);
+	kodi->packets = NULL;
+	free(kodi->keys);
+	kodi->keys = NULL;
+	kodi->fd = -1;
+}
+
+// stand-in EventServer on localhost, prints what it gets until killed
+int vd_kodi_listen(unsigned short port)
+{
+	struct sockaddr_in addr;
+	unsigned char buf[1024];
+	const unsigned char *payload;
+	const char *map;
+	unsigned int type, size;
+	int fd, len;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): listen on port %u\n", __FILE__, __LINE__, __FUNCTION__, port);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	fprintf(stdout, "Listening on 127.0.0.1:%u\n", port);
+	fflush(stdout);
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) >= 0) {
+		buf[len] = 0;
+		if (len < VD_KODI_HEADER || memcmp(buf, "XBMC", 4) != 0) {
+			fprintf(stdout, "bad packet, %d bytes\n", len);
+			continue;
+		}
+		type = vd_kodi_get16(buf + 6);
+		size = vd_kodi_get16(buf + 16);
+		payload = buf + VD_KODI_HEADER;
+		if (VD_KODI_HEADER + size > (unsigned int)len) {
+			fprintf(stdout, "short packet, %d bytes\n", len);
+		} else if (type == VD_KODI_PT_HELO) {
+			fprintf(stdout, "HELO %s\n", payload);
+		} else if (type == VD_KODI_PT_BUTTON && size >= 8) {
+			map = (const char *)payload + 6;
+			fprintf(stdout, "BUTTON %s %s flags 0x%02X\n", map, map + strlen(map) + 1, vd_kodi_get16(payload + 2));
+		} else if (type == VD_KODI_PT_PING) {
+			fprintf(stdout, "PING\n");
+		} else if (type == VD_KODI_PT_BYE) {
+			fprintf(stdout, "BYE\n");
+		} else {
+			fprintf(stdout, "type 0x%02X, %u bytes\n", type, size);
+		}
+		fflush(stdout);
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+* virtual_device_input_event
+*/
+static volatile sig_atomic_t stop = 0;
+
+static void interrupt_handler(int sig)
+{
+	stop = 1;
+}
+
+int test_grab(int fd, int grab_flag)
+{
+	int rc;
+
+	rc = ioctl(fd, EVIOCGRAB, (void*)1);
+
+	if (rc == 0 && !grab_flag)
+		ioctl(fd, EVIOCGRAB, (void*)0);
+
+	return rc;
+}
+
+int input_event_open(const char *phys)
+{
+	int fd;
+
+	if ((fd = open(phys, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): open input device %s\n", __FILE__, __LINE__, __FUNCTION__, phys);
 		if (errno == EACCES && getuid() != 0)
 			fprintf(stderr, "You do not have access to %s. Try "
 					"running as root instead.\n",
@@ -756,63 +2612,1547 @@ int input_event_open(const char *phys)
 		return -1;
 	}
 
-	if (!isatty(fileno(stdout)))
-		setbuf(stdout, NULL);
+	// timestamps comparable with clock_gettime(CLOCK_MONOTONIC)
+	ioctl(fd, EVIOCSCLOCKID, &(int){CLOCK_MONOTONIC});
+
+	if (!isatty(fileno(stdout)))
+		setbuf(stdout, NULL);
+
+	return fd;
+}
+
+int input_event_read(int fd, struct input_event *ev, size_t size, struct timeval *timeout)
+{
+	int rd, ret;
+	fd_set rdfs;
+
+	FD_ZERO(&rdfs);
+	FD_SET(fd, &rdfs);
+	ret = select(fd + 1, &rdfs, NULL, NULL, timeout);
+
+	// !todo
+	if (ret <= 0 || (!ret && timeout))
+		return ret;
+
+	//if (!FD_ISSET(fd, &rdfs)) {
+	//	fprintf(stderr, "Error %s (%d) %s(): FD_ISSET() == 0\n", __FILE__, __LINE__, __FUNCTION__);
+	//	return -1;
+	//}
+	// odot!
+
+	if ((rd = read(fd, ev, size)) < size) {//(int)sizeof(struct input_event)) {
+		fprintf(stderr, "Error %s (%d) %s(): failed to read input event\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	VD_TRACE(VD_TRACE_READ, read, ev->type, ev->code, ev->value);
+	//fprintf(stdout, "event: %02X, %04X, %i", ev->type, ev->code, ev->value);
+
+	return 1;
+}
+
+// number of events, 0 - nothing to read, -1 - error
+int input_event_read_batch(int fd, struct input_event *ev, int count)
+{
+	int rd, i;
+
+	if ((rd = read(fd, ev, count * sizeof(struct input_event))) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		fprintf(stderr, "Error %s (%d) %s(): failed to read input event\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+
+	count = rd / sizeof(struct input_event);
+	for (i = 0; i < count; i++)
+		VD_TRACE(VD_TRACE_READ, read, ev[i].type, ev[i].code, ev[i].value);
+
+	return count;
+}
+
+/*
+* virtual_device_input_discover
+*/
+#ifndef VD_INPUT_CACHE
+#define VD_INPUT_CACHE "/var/cache/virtual_input.cache"
+#endif
+#define VD_INPUT_PROBE_MAX 64
+
+struct input_event_probe {
+	const char *rule;
+	char path[sizeof("/dev/input/") + NAME_MAX];
+	int match;
+	int started;
+	pthread_t thread;
+};
+
+// "auto", "name:GLOB", "phys:GLOB" or "bus:N" instead of a device path
+int input_event_is_rule(const char *input)
+{
+	return strcasecmp(input, "auto") == 0 || strncasecmp(input, "name:", 5) == 0
+		|| strncasecmp(input, "phys:", 5) == 0 || strncasecmp(input, "bus:", 4) == 0;
+}
+
+// 1 - the device behind fd matches the rule
+static int input_event_match(int fd, const char *rule)
+{
+	unsigned long evbit[NBITS(EV_MAX + 1)], mscbit[NBITS(MSC_MAX + 1)];
+	char buf[256];
+	struct input_id id;
+
+	memset(&id, 0, sizeof(id));
+	if (strncasecmp(rule, "name:", 5) == 0 || strncasecmp(rule, "phys:", 5) == 0) {
+		memset(buf, 0, sizeof(buf));
+		if (ioctl(fd, rule[0] == 'n' || rule[0] == 'N' ? EVIOCGNAME(sizeof(buf) - 1) : EVIOCGPHYS(sizeof(buf) - 1), buf) < 0)
+			return 0;
+		return fnmatch(rule + 5, buf, 0) == 0;
+	}
+
+	if (strncasecmp(rule, "bus:", 4) == 0)
+		return ioctl(fd, EVIOCGID, &id) == 0 && id.bustype == strtol(rule + 4, NULL, 0);
+
+	// auto, a receiver reports scancodes
+	memset(evbit, 0, sizeof(evbit));
+	memset(mscbit, 0, sizeof(mscbit));
+	return ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), evbit) >= 0 && TEST_BIT(EV_MSC, evbit)
+		&& ioctl(fd, EVIOCGBIT(EV_MSC, sizeof(mscbit)), mscbit) >= 0 && TEST_BIT(MSC_SCAN, mscbit);
+}
+
+// 1 - the input device of /dev/input/eventN belongs to an rc-core receiver (.../rc/rcN/inputM)
+static int input_event_is_rc(const char *path)
+{
+	char link[64], sysfs[PATH_MAX];
+
+	snprintf(link, sizeof(link), "/sys/class/input/%s/device", path + 11);
+	return realpath(link, sysfs) != NULL && strstr(sysfs, "/rc/rc") != NULL;
+}
+
+static void *input_event_probe_thread(void *arg)
+{
+	struct input_event_probe *probe = arg;
+	int fd;
+
+	if ((fd = open(probe->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) >= 0) {
+		probe->match = input_event_match(fd, probe->rule);
+		close(fd);
+	}
+	// auto, a remote receiver wins over a keyboard that also reports MSC_SCAN
+	if (probe->match && strcasecmp(probe->rule, "auto") == 0)
+		probe->match += input_event_is_rc(probe->path);
+	return NULL;
+}
+
+static int input_event_node_cmp(const void *a, const void *b)
+{
+	const struct input_event_probe *x = a, *y = b;
+	return atoi(x->path + 16) - atoi(y->path + 16);
+}
+
+// /dev/input/eventN of the sysfs input device, 0 - found
+static int input_event_sysfs_node(const char *sysfs, char *path, size_t size)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int ret = -1;
+
+	if ((dir = opendir(sysfs)) == NULL)
+		return -1;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "event", 5) == 0) {
+			snprintf(path, size, "/dev/input/%s", entry->d_name);
+			ret = 0;
+			break;
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+// first matching node of the inputM devices in a parent directory, -1 - none
+static int input_event_parent_open(const char *parent, const char *rule, char *path, size_t size)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char sysfs[PATH_MAX];
+	int fd = -1;
+
+	if ((dir = opendir(parent)) == NULL)
+		return -1;
+	while (fd < 0 && (entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "input", 5) != 0 || !isdigit((unsigned char)entry->d_name[5]))
+			continue;
+		snprintf(sysfs, sizeof(sysfs), "%s/%s", parent, entry->d_name);
+		if (input_event_sysfs_node(sysfs, path, size) == 0 && (fd = input_event_open(path)) >= 0
+			&& !input_event_match(fd, rule)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	closedir(dir);
+	return fd;
+}
+
+// open the node remembered for the rule if it still matches, -1 - probe again
+static int input_event_cache_open(const char *rule, const char *cache)
+{
+	FILE *f;
+	char line[PATH_MAX + 256], path[sizeof("/dev/input/") + NAME_MAX], *sysfs;
+	int fd = -1;
+
+	if ((f = fopen(cache, "r")) == NULL)
+		return -1;
+	// a line per rule, the input and every merge rule have their own
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((sysfs = strchr(line, '\t')) == NULL)
+			continue;
+		*sysfs++ = 0;
+		sysfs[strcspn(sysfs, "\n")] = 0;
+		if (strcmp(line, rule) == 0) {
+			fd = input_event_parent_open(sysfs, rule, path, sizeof(path));
+			break;
+		}
+	}
+	fclose(f);
+	if (fd >= 0)
+		fprintf(stdout, "Input device %s (cached %s)\n", path, sysfs);
+	return fd;
+}
+
+// the directory of the inputM device (.../input of a HID device, .../rc/rcN of a receiver),
+// M is renumbered on every boot but the parent keeps its path
+static void input_event_cache_save(const char *rule, const char *cache, const char *path)
+{
+	FILE *f;
+	char link[64], sysfs[PATH_MAX], line[PATH_MAX + 256], *sep, *lines = NULL;
+	size_t size = 0, len;
+
+	snprintf(link, sizeof(link), "/sys/class/input/%s/device", path + 11);
+	if (realpath(link, sysfs) == NULL || (sep = strrchr(sysfs, '/')) == NULL)
+		return;
+	*sep = 0;
+
+	// keep the lines of the other rules
+	if ((f = fopen(cache, "r")) != NULL) {
+		len = strlen(rule);
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (strncmp(line, rule, len) == 0 && line[len] == '\t')
+				continue;
+			if ((sep = realloc(lines, size + strlen(line) + 1)) == NULL)
+				break;
+			lines = sep;
+			strcpy(lines + size, line);
+			size += strlen(line);
+		}
+		fclose(f);
+	}
+	if ((f = fopen(cache, "w")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): save input cache to %s failed.\n", __FILE__, __LINE__, __FUNCTION__, cache);
+		free(lines);
+		return;
+	}
+	if (lines != NULL)
+		fputs(lines, f);
+	fprintf(f, "%s\t%s\n", rule, sysfs);
+	fclose(f);
+	free(lines);
+}
+
+// cached node, or every /dev/input/event* probed at once, the lowest matching number wins,
+// for auto the lowest rc-core receiver, or the only device with scancodes
+int input_event_discover(const char *rule, const char *cache)
+{
+	struct input_event_probe probes[VD_INPUT_PROBE_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	int i, count = 0, skipped = 0, best = 0, matches = 0, fd = -1;
+
+	if (cache == NULL)
+		cache = VD_INPUT_CACHE;
+	if ((fd = input_event_cache_open(rule, cache)) >= 0)
+		return fd;
+
+	if ((dir = opendir("/dev/input")) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): open /dev/input\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "event", 5) != 0)
+			continue;
+		if (count == VD_INPUT_PROBE_MAX) {
+			skipped++;
+			continue;
+		}
+		memset(&probes[count], 0, sizeof(struct input_event_probe));
+		probes[count].rule = rule;
+		snprintf(probes[count].path, sizeof(probes[count].path), "/dev/input/%s", entry->d_name);
+		count++;
+	}
+	closedir(dir);
+	if (skipped)
+		fprintf(stderr, "Error %s (%d) %s(): more than %d input devices, %d not probed\n", __FILE__, __LINE__, __FUNCTION__, VD_INPUT_PROBE_MAX, skipped);
+	qsort(probes, count, sizeof(struct input_event_probe), input_event_node_cmp);
+
+	// a slow device (bluetooth, suspended usb) does not hold up the others
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&probes[i].thread, NULL, input_event_probe_thread, &probes[i]) == 0)
+			probes[i].started = 1;
+		else
+			input_event_probe_thread(&probes[i]);
+	}
+	for (i = 0; i < count; i++)
+		if (probes[i].started)
+			pthread_join(probes[i].thread, NULL);
+
+	for (i = 0; i < count; i++) {
+		if (probes[i].match > best) {
+			best = probes[i].match;
+			matches = 0;
+		}
+		if (probes[i].match == best)
+			matches++;
+	}
+	// several keyboards and no receiver, the lowest one is a guess
+	if (best == 1 && matches > 1 && strcasecmp(rule, "auto") == 0) {
+		fprintf(stderr, "Error %s (%d) %s(): %d devices report scancodes and none is an rc receiver, set input to name:, phys: or bus:\n", __FILE__, __LINE__, __FUNCTION__, matches);
+		for (i = 0; i < count; i++)
+			if (probes[i].match)
+				fprintf(stderr, "  %s\n", probes[i].path);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (best && probes[i].match == best && (fd = input_event_open(probes[i].path)) >= 0) {
+			fprintf(stdout, "Input device %s (%s)\n", probes[i].path, rule);
+			input_event_cache_save(rule, cache, probes[i].path);
+			return fd;
+		}
+	}
+	fprintf(stderr, "Error %s (%d) %s(): no input device for %s\n", __FILE__, __LINE__, __FUNCTION__, rule);
+	return -1;
+}
+
+void input_event_close(int fd)
+{
+	if (fd != -1)
+        close(fd);
+}
+
+/*
+* virtual_device_main
+*/
+char *read_stdin()
+{
+	char *ptr, buffer[1024];
+	memset(buffer, 0, 1024);
+	ptr = fgets(buffer, 1023, stdin);
+	if (ptr != buffer) {
+		fprintf(stderr, "Error %s (%d) %s(): fgets() failed\n", __FILE__, __LINE__, __FUNCTION__);
+		return 0;
+	}
+	if (ptr[0] == '\n')
+		return 0;
+	buffer[strlen(buffer) - 1] = 0;
+	return ptr;
+}
+
+/*
+* virtual_device_pipeline
+*/
+// replace ev[pos..pos+len) by n events, -1 - no room in the buffer
+static int vd_pipeline_splice(struct vd_pipeline *pipeline, int count, int pos, int len, const struct input_event *ev, int n)
+{
+	if (count - len + n > pipeline->size) {
+		fprintf(stderr, "Error %s (%d) %s(): event buffer full\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	memmove(&pipeline->ev[pos + n], &pipeline->ev[pos + len], (count - pos - len) * sizeof(struct input_event));
+	memcpy(&pipeline->ev[pos], ev, n * sizeof(struct input_event));
+	return count - len + n;
+}
+
+// a frame with a mapped scancode is replaced by key press and release
+static int vd_filter_scancode(struct vd_pipeline *pipeline, int count)
+{
+	struct vd_config *config = pipeline->config;
+	struct input_event *ev = pipeline->ev, keys[16];
+	int i, n = 0, ret, frame = 0, mapped = 0, key_code, kodi_key;
+
+	for (i = 0; i < count; i++) {
+		if (ev[i].type == EV_MSC && (ev[i].code == MSC_RAW || ev[i].code == MSC_SCAN)) {
+			if ((key_code = vd_config_lookup(config, ev[i].value, &ev[i].time)) == 0)
+				continue;
+			mapped = 1;
+			if (key_code < 0 || n + 4 > 16)
+				continue;
+			kodi_key = pipeline->kodi != NULL && pipeline->kodi->fd >= 0
+				? vd_kodi_key(pipeline->kodi, config->layer_lookup, ev[i].value) : -1;
+			if (pipeline->publish->count) {
+				vd_publish_event(pipeline->publish, &ev[i], key_code, 1, config->layer_lookup);
+				vd_publish_event(pipeline->publish, &ev[i], key_code, 0, config->layer_lookup);
+			}
+			memset(&keys[n], 0, 4 * sizeof(struct input_event));
+			keys[n].type = EV_KEY;
+			keys[n].code = key_code;
+			keys[n].value = 1;
+			keys[n + 1].value = VD_FRAME_KEEP | (kodi_key >= 0 ? VD_FRAME_KODI(kodi_key) : 0);
+			keys[n + 2].type = EV_KEY;
+			keys[n + 2].code = key_code;
+			keys[n + 3].value = keys[n + 1].value;
+			n += 4;
+		} else if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) {
+			if (mapped) {
+				if ((ret = vd_pipeline_splice(pipeline, count, frame, i + 1 - frame, keys, n)) >= 0) {
+					i += ret - count;
+					count = ret;
+				}
+				mapped = 0;
+			}
+			frame = i + 1;
+		}
+		if (frame == i + 1)
+			n = 0;
+	}
+	return count;
+}
+
+// remapped keys are rewritten in place, a modifier is pressed before and released
+// after its key, repeats only repeat the key
+static int vd_filter_remap(struct vd_pipeline *pipeline, int count)
+{
+	struct vd_remap *remap;
+	struct input_event *ev = pipeline->ev, modifier;
+	int i, ret, remapped = 0;
+
+	if (pipeline->config->remap == NULL)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) {
+			if (remapped)
+				ev[i].value |= VD_FRAME_KEEP;
+			remapped = 0;
+			continue;
+		}
+		if (ev[i].type != EV_KEY || ev[i].code >= KEY_CNT || !(remap = &pipeline->config->remap[ev[i].code])->code)
+			continue;
+		remapped = 1;
+		modifier = ev[i];
+		ev[i].code = remap->code;
+		if (!remap->modifier || ev[i].value == 2)
+			continue;
+		modifier.code = remap->modifier;
+		if ((ret = vd_pipeline_splice(pipeline, count, ev[i].value ? i : i + 1, 0, &modifier, 1)) >= 0) {
+			count = ret;
+			i++;
+		}
+	}
+	return count;
+}
+
+// multi-tap or T9 letters for the digit keys while text entry is on
+#define VD_TEXT_OUT ((VD_TEXT_WORD_MAX * 2 + 2) * 3)
+
+// 0..9 for a digit key, -1 - other key
+static int vd_text_digit_key(int code)
+{
+	if (code >= KEY_1 && code <= KEY_9)
+		return code - KEY_1 + 1;
+	if (code == KEY_0)
+		return 0;
+	if (code >= KEY_NUMERIC_0 && code <= KEY_NUMERIC_9)
+		return code - KEY_NUMERIC_0;
+	return -1;
+}
+
+// press, release and SYN_REPORT of the key at out[n]
+static int vd_text_key(struct input_event *out, int n, int code)
+{
+	if (n + 3 > VD_TEXT_OUT || code <= 0)
+		return n;
+	memset(&out[n], 0, 3 * sizeof(struct input_event));
+	out[n].type = EV_KEY;
+	out[n].code = code;
+	out[n].value = 1;
+	out[n + 1].type = EV_KEY;
+	out[n + 1].code = code;
+	out[n + 2].value = VD_FRAME_KEEP;
+	return n + 3;
+}
+
+// replace the word on screen
+static int vd_text_show(struct vd_text *text, struct input_event *out, int n, const char *word)
+{
+	while (text->shown > 0) {
+		n = vd_text_key(out, n, KEY_BACKSPACE);
+		text->shown--;
+	}
+	for (; *word; word++, text->shown++)
+		n = vd_text_key(out, n, vd_text_keycode(*word));
+	return n;
+}
+
+static int vd_text_render(struct vd_text *text, struct input_event *out, int n)
+{
+	char fallback[VD_TEXT_WORD_MAX];
+	const char *word;
+	int count, i;
+
+	if ((word = vd_text_candidate(text, text->digits, text->length, text->candidate, &count)) == NULL) {
+		// not in the dictionary, first letters
+		for (i = 0; i < text->length; i++)
+			fallback[i] = vd_text_letters[(int)text->digits[i]][0];
+		fallback[i] = 0;
+		word = fallback;
+	}
+	return vd_text_show(text, out, n, word);
+}
+
+static void vd_text_commit(struct vd_text *text)
+{
+	text->length = 0;
+	text->candidate = 0;
+	text->shown = 0;
+	text->last_digit = -1;
+}
+
+// key: digit 0..9, -1 - next candidate, -2 - backspace
+static int vd_text_press(struct vd_text *text, int key, const struct timeval *time, struct input_event *out)
+{
+	struct timeval elapsed;
+	const char *letters;
+	int n = 0;
+
+	if (text->mode == VD_TEXT_MULTITAP) {
+		if (key < 0) {
+			text->last_digit = -1;
+			return 0;
+		}
+		letters = vd_text_letters[key];
+		timersub(time, &text->last, &elapsed);
+		if (key == text->last_digit && elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000 < text->timeout) {
+			text->tap = (text->tap + 1) % strlen(letters);
+			n = vd_text_key(out, n, KEY_BACKSPACE);
+		} else {
+			text->tap = 0;
+		}
+		text->last_digit = key;
+		text->last = *time;
+		return vd_text_key(out, n, vd_text_keycode(letters[text->tap]));
+	}
+
+	if (key >= 2) {
+		if (text->length == VD_TEXT_WORD_MAX - 1)
+			return 0;
+		text->digits[text->length++] = key;
+		text->candidate = 0;
+		return vd_text_render(text, out, n);
+	}
+	if (key == -1) {
+		text->candidate++;
+		return text->length ? vd_text_render(text, out, n) : 0;
+	}
+	if (key == -2) {
+		text->length--;
+		text->candidate = 0;
+		return vd_text_render(text, out, n);
+	}
+	// 0 and 1 finish the word
+	vd_text_commit(text);
+	return vd_text_key(out, n, vd_text_keycode(key ? '.' : ' '));
+}
+
+static int vd_filter_text(struct vd_pipeline *pipeline, int count)
+{
+	struct vd_text *text = pipeline->config->text;
+	struct input_event *ev = pipeline->ev, out[VD_TEXT_OUT];
+	int i, n, key, ret;
+
+	if (text == NULL)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		if (ev[i].type != EV_KEY)
+			continue;
+
+		if (ev[i].code == text->toggle) {
+			if (ev[i].value == 1) {
+				text->active = !text->active;
+				vd_text_commit(text);
+			}
+			key = -3;
+		} else if (!text->active) {
+			continue;
+		} else if ((key = vd_text_digit_key(ev[i].code)) >= 0) {
+		} else if (ev[i].code == text->next) {
+			key = -1;
+		} else if (ev[i].code == KEY_BACKSPACE && text->mode == VD_TEXT_T9 && text->length) {
+			key = -2;
+		} else {
+			// any other key ends the word
+			if (ev[i].value == 1)
+				vd_text_commit(text);
+			continue;
+		}
+
+		// the key is replaced by its letters, releases and repeats are dropped
+		n = ev[i].value == 1 && key > -3 ? vd_text_press(text, key, &ev[i].time, out) : 0;
+		if ((ret = vd_pipeline_splice(pipeline, count, i, 1, out, n)) >= 0) {
+			i += n - 1;
+			count = ret;
+		}
+	}
+	return count;
+}
+
+// frames the scancode stage recorded a Kodi key on leave the batch, the press
+// as an EventServer packet, a repeat sends the press again, a release nothing
+static int vd_filter_kodi(struct vd_pipeline *pipeline, int count)
+{
+	struct vd_kodi *kodi = pipeline->kodi;
+	struct input_event *ev = pipeline->ev;
+	unsigned int keys[VD_KODI_BATCH];
+	int i, n = 0, out = 0, frame = 0, key, press = 0;
+
+	// while Kodi is off its keys go to uinput
+	if (kodi == NULL || kodi->fd < 0)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		ev[out++] = ev[i];
+		if (ev[i].type == EV_KEY && ev[i].value)
+			press = 1;
+		if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT)
+			continue;
+		if ((key = VD_FRAME_KODI_KEY(ev[i].value)) >= 0) {
+			if (press) {
+				if (n == VD_KODI_BATCH) {
+					vd_kodi_send(kodi, keys, n);
+					n = 0;
+				}
+				keys[n++] = key;
+			}
+			out = frame;
+		}
+		frame = out;
+		press = 0;
+	}
+	if (n)
+		vd_kodi_send(kodi, keys, n);
+	return out;
+}
+
+// last stage, frames a stage handled but left without events (a digit of the text stage)
+// are dropped, with all 0 every other frame is kept too
+static int vd_filter_frames(struct vd_pipeline *pipeline, int count, int all)
+{
+	struct input_event *ev = pipeline->ev;
+	int i, frame = 0, out = 0, events = 0;
+
+	for (i = 0; i < count; i++) {
+		if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT) {
+			events++;
+			continue;
+		}
+		if ((ev[i].value & VD_FRAME_KEEP) ? events : all) {
+			ev[i].value = 0;
+			if (out != frame)
+				memmove(&ev[out], &ev[frame], (i + 1 - frame) * sizeof(struct input_event));
+			out += i + 1 - frame;
+		}
+		frame = i + 1;
+		events = 0;
+	}
+	// a frame larger than the read buffer has no SYN_REPORT yet
+	if (all && frame < count) {
+		if (out != frame)
+			memmove(&ev[out], &ev[frame], (count - frame) * sizeof(struct input_event));
+		out += count - frame;
+	}
+	return out;
+}
+
+// last stage without passthrough, only frames some stage handled are left
+static int vd_filter_drop(struct vd_pipeline *pipeline, int count)
+{
+	return vd_filter_frames(pipeline, count, 0);
+}
+
+// last stage with passthrough, every frame is left as it is
+static int vd_filter_passthrough(struct vd_pipeline *pipeline, int count)
+{
+	return vd_filter_frames(pipeline, count, 1);
+}
+
+// nearest configured code by popcount distance, -1 - none within max or not unique
+#define VD_CORRECT_NEAREST(i, d) do { \
+	if ((d) < best) { \
+		best = (d); \
+		match = (i); \
+		ties = 0; \
+	} else if ((d) == best) { \
+		ties++; \
+	} \
+} while (0)
+
+static int vd_correct_nearest(struct vd_pipeline *pipeline, unsigned int scancode)
+{
+	const unsigned int *codes = pipeline->codes;
+	unsigned int best = pipeline->config->correct + 1, d;
+	int i = 0, match = -1, ties = 0;
+#if defined(__ARM_NEON)
+	uint32x4_t x = vdupq_n_u32(scancode);
+	uint32_t dist[4];
+	int j;
+
+	// four codes at a time, xor and count the bits per byte, then sum up per code
+	for (; i + 4 <= pipeline->code_count; i += 4) {
+		vst1q_u32(dist, vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(veorq_u32(vld1q_u32(codes + i), x))))));
+		for (j = 0; j < 4; j++)
+			VD_CORRECT_NEAREST(i + j, dist[j]);
+	}
+#endif
+	for (; i < pipeline->code_count; i++) {
+		d = __builtin_popcount(codes[i] ^ scancode);
+		VD_CORRECT_NEAREST(i, d);
+	}
+	if (match >= 0 && ties) {
+		pipeline->stats.ambiguous++;
+		return -1;
+	}
+	return match;
+}
+
+static int vd_correct_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+// unknown scancodes within config->correct bits of exactly one configured code are rewritten to it
+static int vd_filter_correct(struct vd_pipeline *pipeline, int count)
+{
+	struct input_event *ev = pipeline->ev;
+	unsigned int scancode;
+	int i, match;
+
+	if (!pipeline->config->correct || !pipeline->code_count)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		if (ev[i].type != EV_MSC || (ev[i].code != MSC_RAW && ev[i].code != MSC_SCAN))
+			continue;
+		scancode = ev[i].value;
+		if (bsearch(&scancode, pipeline->codes, pipeline->code_count, sizeof(unsigned int), vd_correct_cmp) != NULL)
+			continue;
+		if ((match = vd_correct_nearest(pipeline, scancode)) < 0)
+			continue;
+		ev[i].value = pipeline->codes[match];
+		pipeline->stats.corrections++;
+	}
+	return count;
+}
+
+// configured scancodes of every layer, sorted and unique
+static int vd_correct_codes(struct vd_pipeline *pipeline)
+{
+	struct vk_node *node;
+	int count = 0, i;
+
+	for (node = pipeline->config->vks; node != NULL; node = node->next)
+		count++;
+	if ((pipeline->codes = malloc((count + 1) * sizeof(unsigned int))) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
+	}
+	count = 0;
+	for (node = pipeline->config->vks; node != NULL; node = node->next)
+		pipeline->codes[count++] = node->scancode;
+	qsort(pipeline->codes, count, sizeof(unsigned int), vd_correct_cmp);
+	for (i = 0; i < count; i++)
+		if (pipeline->code_count == 0 || pipeline->codes[pipeline->code_count - 1] != pipeline->codes[i])
+			pipeline->codes[pipeline->code_count++] = pipeline->codes[i];
+	return 0;
+}
+
+// scancode of a sequence key, a key name is looked up in the base layer, -1 - unknown
+static long long vd_sequence_scancode(struct vd_config *config, const char *key)
+{
+	struct vk_node *node;
+	char *end;
+	long long scancode;
+
+	for (node = config->vks; node != NULL; node = node->next)
+		if (node->layer == 0 && strcasecmp(node->key, key) == 0)
+			return node->scancode;
+	scancode = strtoll(key, &end, 0);
+	return *end == 0 && scancode >= 0 ? scancode : -1;
+}
+
+// table entry for the sequence action, 0 - unknown
+static int vd_sequence_action(struct vd_config *config, const char *action)
+{
+	const char *name;
+	unsigned int i;
+	int mode;
+
+	if ((mode = vd_layer_mode(action, &name)) != 0) {
+		for (i = 0; i < config->layer_count; i++)
+			if (strcasecmp(config->layers[i].name, name) == 0)
+				return VD_LAYER_ACTION(mode, i);
+		return 0;
+	}
+	return get_input_code(action) > 0 ? get_input_code(action) : 0;
+}
+
+static void vd_sequence_free(struct vd_automaton *fsm)
+{
+	if (fsm == NULL)
+		return;
+	free(fsm->symbols);
+	free(fsm->delta);
+	free(fsm->states);
+	free(fsm->out);
+	free(fsm);
+}
+
+// one trie over the scancodes of all sequences, completed to a DFA by the failure links
+static struct vd_automaton *vd_sequence_build(struct vd_pipeline *pipeline)
+{
+	struct vd_config *config = pipeline->config;
+	struct vd_automaton *fsm;
+	struct vd_sequence *seq;
+	long long scancode;
+	unsigned int i;
+	int j, k, state, next, sym, max_states, *fail = NULL, *queue = NULL, head, tail, action;
+
+	// min and max are set by vd_config_table_rebuild() or the generated keymap
+	if (config->min > config->max) {
+		fprintf(stderr, "Error %s (%d) %s(): sequences without keys\n", __FILE__, __LINE__, __FUNCTION__);
+		return NULL;
+	}
+	if ((fsm = calloc(1, sizeof(struct vd_automaton))) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		return NULL;
+	}
+
+	// dense symbol table over the keys table range, symbol 0 is every other scancode
+	max_states = 1;
+	fsm->symbol_count = 1;
+	if ((fsm->symbols = calloc(config->max - config->min + 1, sizeof(int))) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		goto error;
+	}
+	for (i = 0; i < config->sequence_count; i++) {
+		seq = &config->sequences[i];
+		for (j = 0; j < seq->length; j++) {
+			scancode = vd_sequence_scancode(config, seq->keys[j]);
+			if (scancode < config->min || scancode > config->max) {
+				fprintf(stderr, "Error %s (%d) %s(): sequence key %s is not in the keys table\n", __FILE__, __LINE__, __FUNCTION__, seq->keys[j]);
+				goto error;
+			}
+			if (fsm->symbols[scancode - config->min] == 0)
+				fsm->symbols[scancode - config->min] = fsm->symbol_count++;
+		}
+		max_states += seq->length;
+	}
+
+	fsm->delta = malloc(max_states * fsm->symbol_count * sizeof(int));
+	fsm->states = calloc(max_states, sizeof(struct vd_automaton_state));
+	fail = calloc(max_states, sizeof(int));
+	queue = malloc(max_states * sizeof(int));
+	fsm->out = malloc(pipeline->size * sizeof(struct input_event));
+	if (fsm->delta == NULL || fsm->states == NULL || fail == NULL || queue == NULL || fsm->out == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		goto error;
+	}
+	memset(fsm->delta, -1, max_states * fsm->symbol_count * sizeof(int));
+
+	// trie
+	fsm->state_count = 1;
+	for (i = 0; i < config->sequence_count; i++) {
+		seq = &config->sequences[i];
+		if ((action = vd_sequence_action(config, seq->action)) == 0) {
+			fprintf(stderr, "Error %s (%d) %s(): unknown sequence action %s\n", __FILE__, __LINE__, __FUNCTION__, seq->action);
+			continue;
+		}
+		for (state = 0, j = 0; j < seq->length; j++) {
+			sym = fsm->symbols[vd_sequence_scancode(config, seq->keys[j]) - config->min];
+			if ((next = fsm->delta[state * fsm->symbol_count + sym]) < 0) {
+				next = fsm->state_count++;
+				fsm->delta[state * fsm->symbol_count + sym] = next;
+				fsm->states[next].depth = j + 1;
+				fsm->states[state].more = 1;
+			}
+			if (fsm->states[next].timeout < seq->timeout)
+				fsm->states[next].timeout = seq->timeout;
+			state = next;
+		}
+		if (fsm->states[state].action == 0) {
+			fsm->states[state].action = action;
+			fsm->states[state].length = seq->length;
+		}
+	}
+
+	// breadth first, a missing transition goes where the failure link goes, and a state
+	// without its own sequence ends the one of its longest suffix
+	head = tail = 0;
+	for (sym = 0; sym < fsm->symbol_count; sym++) {
+		if ((next = fsm->delta[sym]) > 0)
+			queue[tail++] = next;
+		else
+			fsm->delta[sym] = 0;
+	}
+	while (head < tail) {
+		state = queue[head++];
+		for (sym = 0; sym < fsm->symbol_count; sym++) {
+			k = state * fsm->symbol_count + sym;
+			if ((next = fsm->delta[k]) < 0) {
+				fsm->delta[k] = fsm->delta[fail[state] * fsm->symbol_count + sym];
+				continue;
+			}
+			fail[next] = fsm->delta[fail[state] * fsm->symbol_count + sym];
+			if (fsm->states[next].action == 0) {
+				fsm->states[next].action = fsm->states[fail[next]].action;
+				fsm->states[next].length = fsm->states[fail[next]].length;
+			}
+			queue[tail++] = next;
+		}
+	}
+	free(fail);
+	free(queue);
+	return fsm;
+
+error:
+	free(fail);
+	free(queue);
+	vd_sequence_free(fsm);
+	return NULL;
+}
+
+static int vd_sequence_copy(struct vd_pipeline *pipeline, int n, const struct input_event *ev, int len)
+{
+	if (n + len > pipeline->size) {
+		fprintf(stderr, "Error %s (%d) %s(): event buffer full\n", __FILE__, __LINE__, __FUNCTION__);
+		return n;
+	}
+	memcpy(&pipeline->automaton->out[n], ev, len * sizeof(struct input_event));
+	return n + len;
+}
+
+// the first frames of the held keys go on as they are
+static int vd_sequence_flush(struct vd_pipeline *pipeline, int n, int keys)
+{
+	struct vd_automaton *fsm = pipeline->automaton;
+	int i, frames = 0;
+
+	for (i = 0; frames < keys && i < fsm->held_count; i++)
+		if (fsm->held[i].type == EV_SYN && fsm->held[i].code == SYN_REPORT)
+			frames++;
+	n = vd_sequence_copy(pipeline, n, fsm->held, i);
+	fsm->held_count -= i;
+	fsm->held_keys -= frames;
+	memmove(fsm->held, fsm->held + i, fsm->held_count * sizeof(struct input_event));
+	return n;
+}
+
+// the sequence of the state replaces its keys, the held keys before it go on
+static int vd_sequence_fire(struct vd_pipeline *pipeline, int n, int state, const struct timeval *time)
+{
+	struct vd_automaton *fsm = pipeline->automaton;
+	struct input_event key[4];
+	int key_code;
+
+	n = vd_sequence_flush(pipeline, n, fsm->held_keys - fsm->states[state].length);
+	fsm->held_count = 0;
+	fsm->held_keys = 0;
+	fsm->state = 0;
+	if ((key_code = vd_config_action(pipeline->config, fsm->states[state].action, time)) <= 0)
+		return n;
+	memset(key, 0, sizeof(key));
+	key[0].time = *time;
+	key[0].type = EV_KEY;
+	key[0].code = key_code;
+	key[0].value = 1;
+	key[1].time = *time;
+	key[1].value = VD_FRAME_KEEP;
+	key[2] = key[0];
+	key[2].value = 0;
+	key[3] = key[1];
+	return vd_sequence_copy(pipeline, n, key, 4);
+}
+
+// no next key in time, a complete sequence fires, the rest goes on
+static int vd_sequence_expire(struct vd_pipeline *pipeline, int n)
+{
+	struct vd_automaton *fsm = pipeline->automaton;
+
+	if (fsm->states[fsm->state].action)
+		return vd_sequence_fire(pipeline, n, fsm->state, &fsm->deadline);
+	n = vd_sequence_flush(pipeline, n, fsm->held_keys);
+	fsm->state = 0;
+	return n;
+}
+
+// one transition per key, the frame is held while the keys are a prefix of a sequence
+static int vd_sequence_key(struct vd_pipeline *pipeline, int n, const struct input_event *ev, int len, unsigned int scancode, const struct timeval *time)
+{
+	struct vd_automaton *fsm = pipeline->automaton;
+	struct vd_config *config = pipeline->config;
+	struct timeval timeout;
+	int sym, next;
+
+	sym = scancode >= config->min && scancode <= config->max ? fsm->symbols[scancode - config->min] : 0;
+	next = fsm->delta[fsm->state * fsm->symbol_count + sym];
+
+	// a complete sequence that waited for a longer one
+	if (fsm->states[next].depth <= fsm->states[fsm->state].depth && fsm->states[fsm->state].action) {
+		n = vd_sequence_fire(pipeline, n, fsm->state, time);
+		next = fsm->delta[sym];
+	}
+
+	if (fsm->states[next].depth == 0 || fsm->held_count + len > VD_SEQUENCE_HELD) {
+		n = vd_sequence_flush(pipeline, n, fsm->held_keys);
+		fsm->state = 0;
+		return vd_sequence_copy(pipeline, n, ev, len);
+	}
+
+	memcpy(&fsm->held[fsm->held_count], ev, len * sizeof(struct input_event));
+	fsm->held_count += len;
+	fsm->held_keys++;
+	n = vd_sequence_flush(pipeline, n, fsm->held_keys - fsm->states[next].depth);
+	fsm->state = next;
+	if (fsm->states[next].action && !fsm->states[next].more)
+		return vd_sequence_fire(pipeline, n, next, time);
+
+	timeout.tv_sec = fsm->states[next].timeout / 1000;
+	timeout.tv_usec = (fsm->states[next].timeout % 1000) * 1000;
+	timeradd(time, &timeout, &fsm->deadline);
+	return n;
+}
+
+// keys of the sequences are held until they match, mismatch or time out
+static int vd_filter_sequence(struct vd_pipeline *pipeline, int count)
+{
+	struct vd_automaton *fsm = pipeline->automaton;
+	struct input_event *ev = pipeline->ev;
+	struct timespec ts;
+	struct timeval now;
+	int i, frame, scan, n = 0;
+
+	if (fsm == NULL)
+		return count;
+
+	// also run with no events when vd_sequence_timeout() is due
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now.tv_sec = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+	if (fsm->state && timercmp(&now, &fsm->deadline, >))
+		n = vd_sequence_expire(pipeline, n);
+
+	for (frame = 0; frame < count; frame = i + 1) {
+		scan = -1;
+		for (i = frame; i < count; i++) {
+			if (ev[i].type == EV_MSC && (ev[i].code == MSC_RAW || ev[i].code == MSC_SCAN) && scan < 0)
+				scan = i;
+			if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT)
+				break;
+		}
+		if (i == count)
+			i--;
+		if (scan < 0) {
+			n = vd_sequence_copy(pipeline, n, &ev[frame], i + 1 - frame);
+			continue;
+		}
+		if (fsm->state && timercmp(&ev[scan].time, &fsm->deadline, >))
+			n = vd_sequence_expire(pipeline, n);
+		n = vd_sequence_key(pipeline, n, &ev[frame], i + 1 - frame, ev[scan].value, &ev[scan].time);
+	}
+	memcpy(ev, fsm->out, n * sizeof(struct input_event));
+	return n;
+}
+
+// ms until the held keys time out, -1 - none held
+int vd_sequence_timeout(struct vd_pipeline *pipeline)
+{
+	struct timespec ts;
+	struct timeval now, left;
+
+	if (pipeline->automaton == NULL || pipeline->automaton->state == 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now.tv_sec = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+	if (!timercmp(&pipeline->automaton->deadline, &now, >))
+		return 0;
+	timersub(&pipeline->automaton->deadline, &now, &left);
+	return left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+}
+static const vd_filter vd_filters[] = {
+	[VD_FILTER_SCANCODE] = vd_filter_scancode,
+	[VD_FILTER_REMAP] = vd_filter_remap,
+	[VD_FILTER_TEXT] = vd_filter_text,
+	[VD_FILTER_CORRECT] = vd_filter_correct,
+	[VD_FILTER_KODI] = vd_filter_kodi,
+	[VD_FILTER_SEQUENCE] = vd_filter_sequence,
+};
+
+// stages from the "filter" lines, or the ones the config needs, and passthrough or drop
+int vd_pipeline_init(struct vd_pipeline *pipeline, struct vd_config *config, int vd_fd, struct vd_publish *publish, struct vd_kodi *kodi)
+{
+	int i;
+
+	memset(pipeline, 0, sizeof(struct vd_pipeline));
+	pipeline->config = config;
+	pipeline->publish = publish;
+	pipeline->kodi = kodi;
+	pipeline->vd_fd = vd_fd;
+
+	if (config->filter_count) {
+		for (i = 0; i < config->filter_count; i++)
+			pipeline->stages[pipeline->count++] = vd_filters[config->filters[i]];
+	} else {
+		if (config->vks != NULL && config->correct)
+			pipeline->stages[pipeline->count++] = vd_filter_correct;
+		if (config->sequence_count)
+			pipeline->stages[pipeline->count++] = vd_filter_sequence;
+		if (config->vks != NULL)
+			pipeline->stages[pipeline->count++] = vd_filter_scancode;
+		if (config->kodi != NULL)
+			pipeline->stages[pipeline->count++] = vd_filter_kodi;
+		if (config->remap != NULL)
+			pipeline->stages[pipeline->count++] = vd_filter_remap;
+		if (config->text != NULL)
+			pipeline->stages[pipeline->count++] = vd_filter_text;
+	}
+	pipeline->stages[pipeline->count++] = config->passthrough ? vd_filter_passthrough : vd_filter_drop;
+
+	// every stage may double a batch
+	pipeline->size = VD_EVENT_BATCH * 4;
+	pipeline->ev = malloc(pipeline->size * sizeof(struct input_event));
+	pipeline->tail = malloc(VD_EVENT_BATCH * sizeof(struct input_event));
+	if (pipeline->ev == NULL || pipeline->tail == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		vd_pipeline_free(pipeline);
+		return -1;
+	}
+	if (vd_output_init(&pipeline->output, vd_fd, config->output_queue) < 0
+		|| (config->correct && vd_correct_codes(pipeline) < 0)
+		|| (config->sequence_count && (pipeline->automaton = vd_sequence_build(pipeline)) == NULL)) {
+		vd_pipeline_free(pipeline);
+		return -1;
+	}
+	return 0;
+}
+
+// complete frames in pipeline->ev through every stage, returns events left to write
+int vd_pipeline_run(struct vd_pipeline *pipeline, int count)
+{
+	int i;
 
-	return fd;
+	// autorepeat syncs of the input core come with SYN_REPORT 1, only a stage may mark a frame
+	for (i = 0; i < count; i++)
+		if (pipeline->ev[i].type == EV_SYN && pipeline->ev[i].code == SYN_REPORT)
+			pipeline->ev[i].value = 0;
+
+	// with no events too, a stage may have timed out events of its own
+	for (i = 0; i < pipeline->count; i++)
+		count = pipeline->stages[i](pipeline, count);
+	return count;
 }
 
-int input_event_read(int fd, struct input_event *ev, size_t size, struct timeval *timeout)
+// complete frames in pipeline->ev through the stages to the output queue
+void vd_pipeline_write(struct vd_pipeline *pipeline, int count)
 {
-	int rd, ret;
-	fd_set rdfs;
+	vd_output_write(&pipeline->output, pipeline->ev, vd_pipeline_run(pipeline, count));
+	vd_output_flush(&pipeline->output);
+}
 
-	FD_ZERO(&rdfs);
-	FD_SET(fd, &rdfs);
-	ret = select(fd + 1, &rdfs, NULL, NULL, timeout);
+// read, run the complete frames and write them with one write(), -1 - read error
+int vd_pipeline_input(struct vd_pipeline *pipeline, int fd)
+{
+	int count, frame;
 
-	// !todo
-	if (ret <= 0 || (!ret && timeout))
-		return ret;
+	if ((count = input_event_read_batch(fd, pipeline->ev + pipeline->pending, VD_EVENT_BATCH - pipeline->pending)) < 0)
+		return -1;
+	count += pipeline->pending;
 
-	//if (!FD_ISSET(fd, &rdfs)) {
-	//	fprintf(stderr, "Error %s (%d) %s(): FD_ISSET() == 0\n", __FILE__, __LINE__, __FUNCTION__);
-	//	return -1;
-	//}
-	// odot!
+	for (frame = count; frame > 0; frame--)
+		if (pipeline->ev[frame - 1].type == EV_SYN && pipeline->ev[frame - 1].code == SYN_REPORT)
+			break;
+	// a frame larger than the buffer goes as it is
+	if (frame == 0 && count == VD_EVENT_BATCH)
+		frame = count;
 
-	if ((rd = read(fd, ev, size)) < size) {//(int)sizeof(struct input_event)) {
-		fprintf(stderr, "Error %s (%d) %s(): failed to read input event\n", __FILE__, __LINE__, __FUNCTION__);
+	// stages may grow the batch over an incomplete frame
+	pipeline->pending = count - frame;
+	if (pipeline->pending)
+		memcpy(pipeline->tail, pipeline->ev + frame, pipeline->pending * sizeof(struct input_event));
+
+	vd_pipeline_write(pipeline, frame);
+
+	if (pipeline->pending)
+		memcpy(pipeline->ev, pipeline->tail, pipeline->pending * sizeof(struct input_event));
+	return 0;
+}
+
+// stages with nothing read, for the events they held back, -1 - nothing due
+int vd_pipeline_expire(struct vd_pipeline *pipeline)
+{
+	if (vd_sequence_timeout(pipeline) != 0)
+		return -1;
+	// the incomplete frame of the last read is at the start of the buffer
+	if (pipeline->pending)
+		memcpy(pipeline->tail, pipeline->ev, pipeline->pending * sizeof(struct input_event));
+	vd_pipeline_write(pipeline, 0);
+	if (pipeline->pending)
+		memcpy(pipeline->ev, pipeline->tail, pipeline->pending * sizeof(struct input_event));
+	return 0;
+}
+
+void vd_pipeline_free(struct vd_pipeline *pipeline)
+{
+	free(pipeline->ev);
+	free(pipeline->tail);
+	free(pipeline->codes);
+	pipeline->ev = NULL;
+	pipeline->tail = NULL;
+	pipeline->codes = NULL;
+	pipeline->code_count = 0;
+	vd_output_free(&pipeline->output);
+	vd_sequence_free(pipeline->automaton);
+	pipeline->automaton = NULL;
+}
+
+static volatile sig_atomic_t vd_stats_pending = 0;
+
+static void stats_handler(int sig)
+{
+	vd_stats_pending = 1;
+}
+
+void vd_stats_print(FILE *f, const struct vd_pipeline *pipeline)
+{
+	fprintf(f, "corrections %lu ambiguous %lu output %u max %u dropped %lu\n",
+		pipeline->stats.corrections, pipeline->stats.ambiguous,
+		pipeline->output.count, pipeline->output.max_count, pipeline->output.dropped);
+	if (pipeline->kodi != NULL && pipeline->kodi->packets != NULL)
+		fprintf(f, "kodi sent %lu errors %lu\n", pipeline->kodi->sent, pipeline->kodi->errors);
+	fflush(f);
+}
+
+/*
+* virtual_device_merge
+*/
+void vd_merge_init(struct vd_merge *merge, unsigned int window)
+{
+	memset(merge, 0, sizeof(struct vd_merge));
+	window = window ? window : VD_MERGE_WINDOW;
+	merge->window.tv_sec = window / 1000;
+	merge->window.tv_usec = (window % 1000) * 1000;
+}
+
+int vd_merge_add(struct vd_merge *merge, int fd)
+{
+	struct vd_source *src;
+
+	if (merge->count == VD_MERGE_MAX)
+		return -1;
+	src = &merge->sources[merge->count];
+	if ((src->queue = malloc(VD_EVENT_BATCH * sizeof(struct input_event))) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
 		return -1;
 	}
+	src->fd = fd;
+	src->count = 0;
+	src->pending = 0;
+	return merge->count++;
+}
+
+// a source with a full queue is not read until its frames are out
+int vd_merge_pollfd(struct vd_merge *merge, struct pollfd *fds)
+{
+	int i;
+
+	for (i = 0; i < merge->count; i++) {
+		fds[i].fd = merge->sources[i].fd;
+		fds[i].events = merge->sources[i].count + merge->sources[i].pending < VD_EVENT_BATCH ? POLLIN : 0;
+	}
+	return merge->count;
+}
 
-	//fprintf(stdout, "event: %02X, %04X, %i", ev->type, ev->code, ev->value);
+// -1 - read error
+int vd_merge_read(struct vd_merge *merge, int i)
+{
+	struct vd_source *src = &merge->sources[i];
+	int n, total;
 
-	return 1;
+	total = src->count + src->pending;
+	if ((n = input_event_read_batch(src->fd, src->queue + total, VD_EVENT_BATCH - total)) < 0)
+		return -1;
+	total += n;
+
+	for (n = total; n > src->count; n--)
+		if (src->queue[n - 1].type == EV_SYN && src->queue[n - 1].code == SYN_REPORT)
+			break;
+	// a frame larger than the queue goes as it is
+	if (n == 0 && total == VD_EVENT_BATCH)
+		n = total;
+	src->count = n;
+	src->pending = total - n;
+	return 0;
 }
 
-void input_event_close(int fd)
+// length of the first frame of the source
+static int vd_merge_frame(struct vd_source *src)
 {
-	if (fd != -1)
-        close(fd);
+	int i;
+
+	for (i = 0; i < src->count - 1; i++)
+		if (src->queue[i].type == EV_SYN && src->queue[i].code == SYN_REPORT)
+			break;
+	return i + 1;
+}
+
+// the frames that are due through the pipeline, oldest first, returns ms
+// until the next one is due, -1 - nothing waits
+int vd_merge_run(struct vd_merge *merge, struct vd_pipeline *pipeline)
+{
+	struct vd_source *src, *oldest;
+	struct timespec ts;
+	struct timeval now, due, *time, *first = NULL;
+	int i, n = 0, len, all, timeout = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now.tv_sec = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+
+	for (;;) {
+		oldest = NULL;
+		all = 1;
+		for (i = 0; i < merge->count; i++) {
+			src = &merge->sources[i];
+			if (src->count == 0) {
+				all = 0;
+				continue;
+			}
+			time = &src->queue[vd_merge_frame(src) - 1].time;
+			if (oldest == NULL || timercmp(time, first, <)) {
+				oldest = src;
+				first = time;
+			}
+		}
+		if (oldest == NULL)
+			break;
+
+		// with a frame from every source the oldest one can not be overtaken,
+		// otherwise it waits for the window
+		timeradd(first, &merge->window, &due);
+		if (!all && timercmp(&due, &now, >)) {
+			timersub(&due, &now, &due);
+			timeout = due.tv_sec * 1000 + (due.tv_usec + 999) / 1000;
+			break;
+		}
+
+		len = vd_merge_frame(oldest);
+		if (n + len > VD_EVENT_BATCH) {
+			vd_pipeline_write(pipeline, n);
+			n = 0;
+		}
+		memcpy(pipeline->ev + n, oldest->queue, len * sizeof(struct input_event));
+		n += len;
+		oldest->count -= len;
+		memmove(oldest->queue, oldest->queue + len, (oldest->count + oldest->pending) * sizeof(struct input_event));
+	}
+	if (n)
+		vd_pipeline_write(pipeline, n);
+	return timeout;
+}
+
+void vd_merge_free(struct vd_merge *merge)
+{
+	int i;
+
+	for (i = 0; i < merge->count; i++)
+		free(merge->sources[i].queue);
+	merge->count = 0;
 }
 
 /*
-* virtual_device_main
+* virtual_device_selftest
 */
-char *read_stdin()
+#define VD_SELFTEST_COUNT 2000
+#define VD_SELFTEST_TIMEOUT 100 // ms
+
+// grabbed evdev node of the virtual device, -1 - not found
+static int vd_selftest_open(int vd_fd)
 {
-	char *ptr, buffer[1024];
-	memset(buffer, 0, 1024);
-	ptr = fgets(buffer, 1023, stdin);
-	if (ptr != buffer) {
-		fprintf(stderr, "Error %s (%d) %s(): fgets() failed\n", __FILE__, __LINE__, __FUNCTION__);
-		return 0;
+	char sysname[64], path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	int fd = -1;
+
+#ifdef UI_GET_SYSNAME
+	if (ioctl(vd_fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): ioctl(fd, UI_GET_SYSNAME)\n", __FILE__, __LINE__, __FUNCTION__);
+		return -1;
 	}
-	if (ptr[0] == '\n')
-		return 0;
-	buffer[strlen(buffer) - 1] = 0;
-	return ptr;
+#else
+	fprintf(stderr, "Error %s (%d) %s(): UI_GET_SYSNAME not supported\n", __FILE__, __LINE__, __FUNCTION__);
+	return -1;
+#endif
+
+	snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+	if ((dir = opendir(path)) == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): open %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "event", 5) == 0) {
+			snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+			fd = open(path, O_RDONLY | O_NONBLOCK);
+			break;
+		}
+	}
+	closedir(dir);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error %s (%d) %s(): no evdev node for %s\n", __FILE__, __LINE__, __FUNCTION__, sysname);
+		return -1;
+	}
+	// keep the synthetic keys away from everybody else
+	ioctl(fd, EVIOCSCLOCKID, &(int){CLOCK_MONOTONIC});
+	if (ioctl(fd, EVIOCGRAB, (void*)1) < 0)
+		fprintf(stderr, "Error %s (%d) %s(): grab %s\n", __FILE__, __LINE__, __FUNCTION__, path);
+	fprintf(stdout, "Reading %s\n", path);
+	return fd;
+}
+
+static int vd_selftest_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void vd_selftest_report(const char *what, unsigned long long *ns, int count)
+{
+	static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+	unsigned int i;
+
+	if (count == 0)
+		return;
+	qsort(ns, count, sizeof(*ns), vd_selftest_cmp);
+	fprintf(stdout, "%-8s", what);
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		fprintf(stdout, "  p%-5g %8.1f us", percentiles[i] * 100, ns[(int)(percentiles[i] * (count - 1))] / 1000.0);
+	fprintf(stdout, "  max %8.1f us\n", ns[count - 1] / 1000.0);
+}
+
+// inject scancodes through the pipeline and time them to a reader of the evdev node
+int vd_selftest(struct vd_config *config, int count)
+{
+	struct vd_publish publish = {.fd = -1};
+	struct vd_pipeline pipeline;
+	struct input_event ev, events[VD_EVENT_BATCH];
+	struct pollfd fds;
+	struct vk_node *node;
+	struct vd_automaton *fsm;
+	unsigned long long start, stamp, *evdev, *reader;
+	int *scancodes, n = 0, received = 0, vd_fd, fd = -1, i, j, rd, key_code, done, wait, ret = -1;
+
+	for (node = config->vks; node != NULL; node = node->next)
+		n++;
+	scancodes = malloc((n + 1) * sizeof(int));
+	evdev = malloc(count * sizeof(unsigned long long));
+	reader = malloc(count * sizeof(unsigned long long));
+	if (scancodes == NULL || evdev == NULL || reader == NULL) {
+		fprintf(stderr, "Error %s (%d) %s(): out of memory\n", __FILE__, __LINE__, __FUNCTION__);
+		goto free_buffers;
+	}
+
+	if ((vd_fd = vd_create(config, NULL, 0)) < 0)
+		goto free_buffers;
+	if ((fd = vd_selftest_open(vd_fd)) < 0)
+		goto destroy;
+	if (vd_pipeline_init(&pipeline, config, vd_fd, &publish, NULL) < 0)
+		goto close_reader;
+
+	// plain keys of the base layer only, layer switches would change the path and
+	// the first key of a sequence is held until it times out
+	fsm = pipeline.automaton;
+	n = 0;
+	for (node = config->vks; node != NULL; node = node->next)
+		if (config->table != NULL && node->layer == 0 && config->table[node->scancode - config->min] > 0
+				&& (fsm == NULL || fsm->states[fsm->delta[fsm->symbols[node->scancode - config->min]]].depth == 0))
+			scancodes[n++] = node->scancode;
+	if (n == 0) {
+		fprintf(stderr, "Error %s (%d) %s(): no keys in config\n", __FILE__, __LINE__, __FUNCTION__);
+		goto free_pipeline;
+	}
+	fds.fd = fd;
+	fds.events = POLLIN;
+
+	for (i = 0; i < count; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = EV_MSC;
+		ev.code = MSC_SCAN;
+		ev.value = scancodes[i % n];
+		key_code = config->table[ev.value - config->min];
+		start = vd_trace_now();
+		ev.time.tv_sec = start / 1000000000ULL;
+		ev.time.tv_usec = start % 1000000000ULL / 1000;
+
+		pipeline.ev[0] = ev;
+		memset(&pipeline.ev[1], 0, sizeof(struct input_event));
+		vd_pipeline_write(&pipeline, 2);
+
+		// press time on the node, then wait for the release
+		for (done = 0; !done; ) {
+			if (pipeline.output.count)
+				vd_output_flush(&pipeline.output);
+			wait = vd_sequence_timeout(&pipeline);
+			if ((rd = poll(&fds, 1, wait >= 0 && wait < VD_SELFTEST_TIMEOUT ? wait : VD_SELFTEST_TIMEOUT)) < 0)
+				break;
+			// frames a stage held back are written when they are due
+			if (rd == 0) {
+				if (vd_pipeline_expire(&pipeline) < 0)
+					break;
+				continue;
+			}
+			if ((rd = input_event_read_batch(fd, events, VD_EVENT_BATCH)) < 0)
+				break;
+			for (j = 0; j < rd; j++) {
+				if (events[j].type != EV_KEY || events[j].code != key_code)
+					continue;
+				if (events[j].value == 1) {
+					// the kernel stamp is in us, compare it with start in us too
+					stamp = (unsigned long long)events[j].time.tv_sec * 1000000000ULL + events[j].time.tv_usec * 1000ULL;
+					evdev[received] = stamp > start - start % 1000 ? stamp - (start - start % 1000) : 0;
+					reader[received++] = vd_trace_now() - start;
+				} else if (events[j].value == 0) {
+					done = 1;
+				}
+			}
+		}
+	}
+
+	fprintf(stdout, "Sent %d, received %d, lost %d\n", count, received, count - received);
+	// kernel stamps in microseconds, ns of a fast path round down
+	vd_selftest_report("evdev", evdev, received);
+	vd_selftest_report("reader", reader, received);
+
+	ret = received == count ? 0 : 1;
+free_pipeline:
+	vd_pipeline_free(&pipeline);
+close_reader:
+	ioctl(fd, EVIOCGRAB, (void*)0);
+	close(fd);
+destroy:
+	vd_destroy(vd_fd);
+free_buffers:
+	free(scancodes);
+	free(evdev);
+	free(reader);
+	return ret;
 }
 
 int main(int argc, const char *argv[])
@@ -823,22 +4163,44 @@ int main(int argc, const char *argv[])
 
 	struct timeval timeout;
 	struct input_event ev;
-	int key_code, scancode_index;
+	struct pollfd fds[VD_MERGE_MAX + 2 + VD_PUBLISH_MAX];
+	struct vd_publish publish = {.fd = -1};
+	struct vd_pipeline pipeline = {0};
+	struct vd_merge merge = {.count = 0};
+	struct vd_kodi kodi = {.fd = -1};
+	int nfds, nsrc, wait = -1, timeout_ms;
+	int input_fds[VD_MERGE_MAX], input_count = 0;
+	const char *input_names[VD_MERGE_MAX];
 
 	char create_config = 0;
+	int selftest = 0;
+#ifndef VD_GENERATED_KEYMAP
 	FILE *config_file;
-	const char *config_path = NULL;
+#endif
+	const char *config_path = NULL, *emit_path = NULL;
 
 	for (i = 1; i < argc; i++) {
 		if (strcasecmp("--list", argv[i]) == 0) {
 			fprint_namespace();
 			return 0;
+		} else if (strcasecmp("--build-dict", argv[i]) == 0 && i + 2 < argc) {
+			return vd_text_build(argv[i + 1], argv[i + 2]) ? 1 : 0;
+		} else if (strcasecmp("--kodi-listen", argv[i]) == 0) {
+			return vd_kodi_listen(i + 1 < argc ? atoi(argv[i + 1]) : VD_KODI_PORT) ? 1 : 0;
+		} else if (strcasecmp("--trace-print", argv[i]) == 0 && i + 1 < argc) {
+			return vd_trace_print(argv[++i]) ? 1 : 0;
 		} else if (strcasecmp("--name", argv[i]) == 0) {
 			config.name = argv[++i];
 		} else if (strcasecmp("--input", argv[i]) == 0) {
 			config.input = argv[++i];
 		} else if (strcasecmp("--config", argv[i]) == 0) {
 			config_path = argv[++i];
+		} else if (strcasecmp("--selftest", argv[i]) == 0) {
+			selftest = VD_SELFTEST_COUNT;
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0)
+				selftest = atoi(argv[++i]);
+		} else if (strcasecmp("--emit-c", argv[i]) == 0 && i + 1 < argc) {
+			emit_path = argv[++i];
 		} else if (strcasecmp("--create", argv[i]) == 0) {
 			printf("Creating new config.\n");
 			create_config = 1;
@@ -846,6 +4208,12 @@ int main(int argc, const char *argv[])
 	}
 
 load_config:
+#ifdef VD_GENERATED_KEYMAP
+	// the keymap is compiled in, there is no config to read or create
+	vd_generated_config(&config);
+	config_path = VD_GENERATED_KEYMAP;
+	create_config = 0;
+#else
 	if (config_path != NULL) {
 		if ((config_file = fopen(config_path, "r")) == NULL) {
 			if (create_config == 0) {
@@ -860,9 +4228,29 @@ load_config:
 			fclose(config_file);
 		}
 	}
+#endif
+
+	if (selftest) {
+		if (config_path == NULL) {
+			printf("Usage: %s --config FILE --selftest [COUNT]\n", argv[0]);
+			return 1;
+		}
+		vd_config_table_rebuild(&config);
+		return vd_selftest(&config, selftest) ? 1 : 0;
+	}
+
+	if (emit_path != NULL) {
+		if (config_path == NULL) {
+			printf("Usage: %s --config FILE --emit-c FILE\n", argv[0]);
+			return 1;
+		}
+		vd_config_table_rebuild(&config);
+		return vd_config_emit(emit_path, &config) ? 1 : 0;
+	}
 
 open_input_device:
-	if (config.input != NULL && (sunxi_ir_event_fd = input_event_open(config.input)) >= 0) {
+	if (config.input != NULL && (sunxi_ir_event_fd = input_event_is_rule(config.input)
+			? input_event_discover(config.input, config.input_cache) : input_event_open(config.input)) >= 0) {
 		if (test_grab(sunxi_ir_event_fd, 1)) {
 			fprintf(stdout, "***********************************************\n");
 			fprintf(stdout, "  This device is grabbed by another process.\n");
@@ -967,8 +4355,23 @@ read_ev:
 
 	if (config_path != NULL) {
 		if (sunxi_ir_event_fd >= 0) {
+			input_fds[input_count] = sunxi_ir_event_fd;
+			input_names[input_count++] = config.input;
+			for (i = 0; i < config.merge_count; i++) {
+				if ((ret = input_event_is_rule(config.merge[i]) ? input_event_discover(config.merge[i], config.input_cache)
+						: input_event_open(config.merge[i])) < 0 || test_grab(ret, 1)) {
+					fprintf(stderr, "Error %s (%d) %s(): merge device %s\n", __FILE__, __LINE__, __FUNCTION__, config.merge[i]);
+					if (ret >= 0)
+						input_event_close(ret);
+					continue;
+				}
+				input_fds[input_count] = ret;
+				input_names[input_count++] = config.merge[i];
+			}
+#ifndef VD_GENERATED_KEYMAP
 			vd_config_table_rebuild(&config);
-			if ((vd_fd = vd_create(&config)) >= 0) {
+#endif
+			if ((vd_fd = vd_create(&config, input_fds, config.passthrough ? input_count : 0)) >= 0) {
 				stop = 0;
 
 				signal(SIGINT, interrupt_handler);
@@ -978,31 +4381,95 @@ read_ev:
 				signal(SIGQUIT, interrupt_handler);
 				signal(SIGHUP, interrupt_handler);
 
+				vd_trace_init(config.trace, config.trace_threshold);
+				if (config.trace != NULL)
+					signal(SIGUSR1, trace_handler);
+				signal(SIGUSR2, stats_handler);
+
+				if ((config.publish != NULL && vd_publish_open(&publish, config.publish, config.publish_queue, config.publish_policy) < 0)
+					|| (config.text != NULL && vd_text_open(config.text) < 0)
+					|| (config.kodi != NULL && vd_kodi_open(&kodi, &config) < 0)
+					|| vd_pipeline_init(&pipeline, &config, vd_fd, &publish, &kodi) < 0)
+					stop = 1;
+				// one input goes straight to the pipeline, more are merged
+				vd_merge_init(&merge, config.merge_window);
+				for (i = 0; input_count > 1 && i < input_count; i++)
+					if (vd_merge_add(&merge, input_fds[i]) < 0)
+						stop = 1;
+
 				while (!stop) {
-					memset(&ev, 0, sizeof(struct input_event));
-					if (input_event_read(sunxi_ir_event_fd, &ev, sizeof(struct input_event), NULL)) {
-						if (ev.type == EV_MSC && (ev.code == MSC_RAW || ev.code == MSC_SCAN)) {
-							scancode_index = ev.value;
-							if (scancode_index >= config.min && scancode_index <= config.max) {
-								scancode_index = scancode_index - config.min;
-								if ((key_code = config.table[scancode_index]) != 0) {
-									vd_send_event(vd_fd, EV_KEY, key_code, 1);
-									vd_send_event(vd_fd, EV_SYN, SYN_REPORT, 0);
-									usleep(16);
-									vd_send_event(vd_fd, EV_KEY, key_code, 0);
-									vd_send_event(vd_fd, EV_SYN, SYN_REPORT, 0);
-								}
-							}
+					if (merge.count) {
+						nsrc = vd_merge_pollfd(&merge, fds);
+					} else {
+						fds[0].fd = sunxi_ir_event_fd;
+						fds[0].events = POLLIN;
+						nsrc = 1;
+					}
+					// the virtual device only while its output queue is not empty
+					fds[nsrc].fd = pipeline.output.count ? vd_fd : -1;
+					fds[nsrc].events = POLLOUT;
+					nfds = nsrc + 1 + vd_publish_pollfd(&publish, fds + nsrc + 1);
+
+					timeout_ms = vd_kodi_timeout(&kodi);
+					if (wait >= 0 && (timeout_ms < 0 || wait < timeout_ms))
+						timeout_ms = wait;
+					if ((ret = vd_sequence_timeout(&pipeline)) >= 0 && (timeout_ms < 0 || ret < timeout_ms))
+						timeout_ms = ret;
+
+					if (poll(fds, nfds, timeout_ms) < 0) {
+						if (errno != EINTR) {
+							fprintf(stderr, "Error %s (%d) %s(): poll()\n", __FILE__, __LINE__, __FUNCTION__);
+							break;
 						}
 					} else {
-						fprintf(stderr, "Error %s (%d) %s(): input_event_read() != 1\n", __FILE__, __LINE__, __FUNCTION__);
-						break;
+						if ((fds[nsrc].revents & POLLOUT) && vd_output_flush(&pipeline.output) < 0)
+							break;
+						for (i = 0; i < nsrc; i++) {
+							if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+								fprintf(stderr, "Error %s (%d) %s(): input device %s lost\n", __FILE__, __LINE__, __FUNCTION__, input_names[i]);
+								stop = 1;
+								break;
+							}
+							if ((fds[i].revents & POLLIN)
+								&& (merge.count ? vd_merge_read(&merge, i) : vd_pipeline_input(&pipeline, fds[i].fd)) < 0) {
+								fprintf(stderr, "Error %s (%d) %s(): read input device %s\n", __FILE__, __LINE__, __FUNCTION__, input_names[i]);
+								stop = 1;
+								break;
+							}
+						}
+						if (stop)
+							break;
+						vd_publish_poll(&publish, fds + nsrc + 1, nfds - nsrc - 1);
+					}
+					// the poll timeout is the next frame the merge holds back
+					if (merge.count)
+						wait = vd_merge_run(&merge, &pipeline);
+					vd_pipeline_expire(&pipeline);
+					vd_kodi_ping(&kodi);
+
+					if (vd_trace_pending) {
+						vd_trace_pending = 0;
+						if (vd_trace_dump(config.trace) == 0)
+							fprintf(stdout, "Trace dumped to %s\n", config.trace);
+					}
+					if (vd_stats_pending) {
+						vd_stats_pending = 0;
+						vd_stats_print(stdout, &pipeline);
 					}
 				}
+				// counters of what is in use, SIGUSR2 prints them any time
+				if (config.correct || config.output_queue || pipeline.output.dropped || kodi.packets != NULL)
+					vd_stats_print(stdout, &pipeline);
+				vd_merge_free(&merge);
+				vd_pipeline_free(&pipeline);
+				vd_kodi_close(&kodi);
+				vd_publish_close(&publish);
 				vd_destroy(vd_fd);
 			}
-			ioctl(sunxi_ir_event_fd, EVIOCGRAB, (void*)0); // no need if arg2 == 0 in test_grab()
-			input_event_close(sunxi_ir_event_fd);
+			for (i = 0; i < input_count; i++) {
+				ioctl(input_fds[i], EVIOCGRAB, (void*)0);
+				input_event_close(input_fds[i]);
+			}
 		}
 	} else {
 		printf("Usage: github.com/rubitwa/virtual_input_for_ir\n");
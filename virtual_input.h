@@ -1,15 +1,106 @@
 #ifndef _VIRTUAL_INPUT_H_
 #define _VIRTUAL_INPUT_H_
 
+#include <poll.h>
 #include <linux/input.h>
 
 // virtual key node
 struct vk_node {
 	char *key;
 	int scancode;
+	int layer;
 	struct vk_node *next;
+	// Kodi EventServer button "MAP:name", "" - keyboard map, NULL - uinput
+	char *kodi;
 };
 
+// layer switch modes, "mode:layer" in place of the key name
+#define VD_LAYER_MOMENTARY 1
+#define VD_LAYER_TOGGLE 2
+#define VD_LAYER_ONESHOT 3
+// negative table entry for a layer switch
+#define VD_LAYER_ACTION(mode, layer) (-((layer) << 2 | (mode)))
+#define VD_LAYER_MODE(entry) ((-(entry)) & 3)
+#define VD_LAYER_INDEX(entry) ((-(entry)) >> 2)
+
+// keymap layer, layer 0 is the base "begin codes" block
+struct vd_layer {
+	char *name;
+	int *table;
+};
+
+#define VD_FILTER_MAX 8
+#define VD_FILTER_SCANCODE 0
+#define VD_FILTER_REMAP 1
+#define VD_FILTER_TEXT 2
+#define VD_FILTER_CORRECT 3
+#define VD_FILTER_KODI 4
+#define VD_FILTER_SEQUENCE 5
+
+#define VD_TEXT_MULTITAP 1
+#define VD_TEXT_T9 2
+#define VD_TEXT_WORD_MAX 24
+
+// predictive dictionary file, mmap'd as is: header, nodes in breadth-first
+// order (children of a node are contiguous), word offsets, words
+#define VD_DICT_MAGIC "VDDICT1"
+struct vd_dict_header {
+	char magic[8];
+	unsigned int node_count;
+	unsigned int word_count;
+	unsigned int strings_size;
+	unsigned int reserved;
+};
+
+struct vd_dict_node {
+	unsigned int first_child;
+	unsigned int words; // first word offset, best candidate first
+	unsigned short word_count;
+	unsigned char child_count;
+	unsigned char digit;
+};
+
+// text entry with the digit keys
+struct vd_text {
+	int mode;
+	char *dict_path;
+	int toggle; // keycode that switches text entry on and off
+	int next; // keycode that cycles the candidates
+	unsigned int timeout; // ms, multi-tap
+	// mmap'd dictionary
+	const struct vd_dict_header *dict;
+	size_t dict_size;
+	// state
+	int active;
+	char digits[VD_TEXT_WORD_MAX];
+	int length;
+	int candidate;
+	int shown;
+	int last_digit;
+	int tap;
+	struct timeval last;
+};
+
+// EV_KEY remap entry, indexed by the input keycode, code 0 - not remapped
+struct vd_remap {
+	unsigned short code;
+	unsigned short modifier;
+};
+
+#define VD_SEQUENCE_MAX 16 // keys of a sequence
+#define VD_SEQUENCE_HELD 64 // events of the held frames
+
+// "begin sequences" line, ACTION TIMEOUT KEY..., resolved when the automaton is built
+struct vd_sequence {
+	char *action; // key name or "mode:layer"
+	unsigned int timeout; // ms between the keys
+	int length;
+	char *keys[VD_SEQUENCE_MAX]; // key names of the base layer or scancodes
+};
+
+#define VD_MERGE_MAX 8 // input and merge devices
+#define VD_MERGE_WINDOW 5 // ms
+
 // virtual device config
 struct vd_config {
 	char *name;
@@ -19,6 +110,150 @@ struct vd_config {
 	int *table;
 	unsigned int min;
 	unsigned int max;
+	// flight recorder
+	char *trace;
+	unsigned int trace_threshold;
+	// keymap layers, table points to the active one
+	struct vd_layer *layers;
+	unsigned int layer_count;
+	unsigned int layer; // target of vd_config_add_button()
+	unsigned int hold_timeout; // ms
+	unsigned int layer_base;
+	unsigned int layer_active;
+	unsigned int layer_lookup; // layer the last scancode was looked up in
+	int layer_oneshot;
+	int layer_momentary;
+	struct timeval layer_hold;
+	// event fan-out socket
+	char *publish;
+	unsigned int publish_queue;
+	int publish_policy;
+	// forward unmapped events of the grabbed input device
+	int passthrough;
+	// EV_KEY remap table, KEY_CNT entries
+	struct vd_remap *remap;
+	// "filter" lines in order, VD_FILTER_*
+	int filters[VD_FILTER_MAX];
+	int filter_count;
+	// where a discovered input device is remembered
+	char *input_cache;
+	// text entry, NULL - off
+	struct vd_text *text;
+	// max flipped bits of a corrected scancode, 0 - off
+	unsigned int correct;
+	// bound of the virtual device output queue, events
+	unsigned int output_queue;
+	// more input devices merged in ev.time order, "merge" lines
+	char *merge[VD_MERGE_MAX - 1];
+	unsigned int merge_count;
+	unsigned int merge_window; // ms
+	// Kodi EventServer host, NULL - off
+	char *kodi;
+	unsigned int kodi_port;
+	struct vd_sequence *sequences;
+	unsigned int sequence_count;
+};
+
+#define VD_OUTPUT_QUEUE 256
+#define VD_OUTPUT_QUEUE_MAX 4096
+// room over the bound for a release and its SYN_REPORT of every key that can be down
+#define VD_OUTPUT_RESERVE (2 * KEY_CNT)
+
+// events the non-blocking uinput fd did not take yet, written on POLLOUT
+struct vd_output {
+	int fd;
+	struct input_event *queue;
+	unsigned int size; // bound + VD_OUTPUT_RESERVE
+	unsigned int bound;
+	unsigned int head;
+	unsigned int count;
+	unsigned int max_count;
+	unsigned long dropped;
+	// keys whose press was dropped, their repeats and release are dropped too
+	unsigned char dropped_keys[(KEY_CNT + 7) / 8];
+	unsigned int dropped_held; // keys set in dropped_keys
+	// keys whose press was queued, only their releases go over the bound
+	unsigned char down_keys[(KEY_CNT + 7) / 8];
+};
+
+#define VD_PUBLISH_DROP_OLDEST 0
+#define VD_PUBLISH_DISCONNECT 1
+#define VD_PUBLISH_MAX 16
+#define VD_PUBLISH_QUEUE 256
+#define VD_PUBLISH_QUEUE_MAX 4096
+
+// translated key event, one or more per SOCK_SEQPACKET message, native endian
+struct vd_publish_event {
+	unsigned long long time; // CLOCK_MONOTONIC, us
+	unsigned int scancode;
+	unsigned short keycode;
+	unsigned char value; // 1 - press, 0 - release
+	unsigned char layer;
+};
+
+// subscriber with its own bounded ring of events
+struct vd_subscriber {
+	int fd;
+	struct vd_publish_event *queue;
+	unsigned int head;
+	unsigned int count;
+	unsigned long dropped;
+};
+
+struct vd_publish {
+	int fd;
+	char *path;
+	unsigned int queue_size;
+	int policy;
+	unsigned int count;
+	struct vd_subscriber subs[VD_PUBLISH_MAX];
+};
+
+#define VD_KODI_PORT 9777
+#define VD_KODI_PING 30 // s, the EventServer forgets a client after 60
+#define VD_KODI_RETRY 5 // s, between lookups of a host that did not resolve
+#define VD_KODI_BATCH 64
+
+// key of a layer with its BUTTON packet, sorted by scancode, then layer
+struct vd_kodi_key {
+	int scancode;
+	unsigned int layer;
+	unsigned int offset;
+	unsigned int length; // 0 - the key of this layer goes to uinput
+};
+
+// Kodi EventServer client, packets are prebuilt: HELO, PING, then a BUTTON per key
+struct vd_kodi {
+	int fd; // -1 - off until the host resolves
+	unsigned int token;
+	const char *host;
+	unsigned int port;
+	unsigned int retries;
+	unsigned char *packets;
+	unsigned int size;
+	unsigned int helo_length;
+	struct vd_kodi_key *keys;
+	unsigned int key_count;
+	struct timespec ping; // CLOCK_MONOTONIC, next PING, or the next lookup while off
+	unsigned long sent;
+	unsigned long errors;
+};
+
+// flight recorder probes
+#define VD_TRACE_READ 1
+#define VD_TRACE_LOOKUP 2
+#define VD_TRACE_EMIT 3
+#define VD_TRACE_WRITE 4
+
+// flight recorder record, dumped as is after the file header
+struct vd_trace_record {
+	unsigned long long ts; // CLOCK_MONOTONIC, ns
+	unsigned int latency; // ns since the last read probe
+	unsigned short probe;
+	unsigned short type;
+	unsigned short code;
+	unsigned short reserved;
+	int value;
 };
 
 void fprint_namespace(void);
@@ -27,12 +262,143 @@ const char *get_input_name(int code);
 
 int vd_config_read(FILE * f, struct vd_config *config);
 int vd_config_add_button(struct vd_config *config, char *key, int scancode);
+int vd_config_add_layer(struct vd_config *config, const char *name);
+int vd_config_add_remap(struct vd_config *config, int code, int to, int modifier);
 void vd_config_table_rebuild(struct vd_config *config);
-int vd_create(struct vd_config *config);
+void vd_config_layer_select(struct vd_config *config, unsigned int layer);
+int vd_config_lookup(struct vd_config *config, int scancode, const struct timeval *time);
+int vd_config_action(struct vd_config *config, int entry, const struct timeval *time);
+int vd_config_emit(const char *filename, struct vd_config *config);
+int vd_create(struct vd_config *config, const int *input_fds, int count);
 void vd_send_event(int fd, int type, int code, int value);
+void vd_send_events(int fd, const struct input_event *ev, int count);
 void vd_destroy(int fd);
+int vd_output_init(struct vd_output *out, int fd, unsigned int bound);
+void vd_output_write(struct vd_output *out, const struct input_event *ev, int count);
+int vd_output_flush(struct vd_output *out);
+void vd_output_free(struct vd_output *out);
+
+struct vd_pipeline;
+// stage of the event pipeline, edits pipeline->ev[0..count) in place
+// and returns the new count, whole frames only
+typedef int (*vd_filter)(struct vd_pipeline *pipeline, int count);
+
+// a stage that handled a frame marks its SYN_REPORT, see vd_filter_drop()
+#define VD_FRAME_KEEP 1
+// the scancode stage records the Kodi key of a frame above the keep bit
+#define VD_FRAME_KODI(key) (((key) + 1) << 1)
+#define VD_FRAME_KODI_KEY(value) (((value) >> 1) - 1)
+
+// runtime counters, printed on SIGUSR2 and at exit
+struct vd_stats {
+	unsigned long corrections;
+	unsigned long ambiguous; // more than one code at the nearest distance
+};
+
+struct vd_automaton_state {
+	int depth;
+	int more; // a longer sequence goes on from here
+	int action; // table entry of the sequence that ends here, 0 - none
+	int length; // keys of that sequence
+	unsigned int timeout; // ms
+};
+
+// Aho-Corasick automaton over the scancodes of all sequences, state 0 is the root
+struct vd_automaton {
+	int *symbols; // scancode - config->min to symbol, 0 - in no sequence
+	int symbol_count;
+	int *delta; // state * symbol_count + symbol to the next state
+	struct vd_automaton_state *states;
+	int state_count;
+	// frames of the keys that may still become a sequence
+	int state;
+	struct input_event held[VD_SEQUENCE_HELD];
+	int held_count;
+	int held_keys;
+	struct timeval deadline;
+	struct input_event *out;
+};
+
+struct vd_pipeline {
+	struct vd_config *config;
+	struct vd_publish *publish;
+	struct vd_kodi *kodi;
+	int vd_fd;
+	vd_filter stages[VD_FILTER_MAX + 1];
+	int count;
+	// read buffer with room for the stages to grow the batch
+	struct input_event *ev;
+	int size;
+	// incomplete frame of the last read
+	struct input_event *tail;
+	int pending;
+	// sorted configured scancodes for the correct stage
+	unsigned int *codes;
+	int code_count;
+	struct vd_stats stats;
+	struct vd_output output;
+	struct vd_automaton *automaton;
+};
+
+int vd_text_open(struct vd_text *text);
+const char *vd_text_candidate(const struct vd_text *text, const char *digits, int length, int index, int *count);
+int vd_text_build(const char *words_path, const char *dict_path);
+
+int vd_kodi_open(struct vd_kodi *kodi, struct vd_config *config);
+int vd_kodi_key(const struct vd_kodi *kodi, unsigned int layer, int scancode);
+void vd_kodi_send(struct vd_kodi *kodi, const unsigned int *keys, int count);
+int vd_kodi_timeout(struct vd_kodi *kodi);
+void vd_kodi_ping(struct vd_kodi *kodi);
+void vd_kodi_close(struct vd_kodi *kodi);
+int vd_kodi_listen(unsigned short port);
+
+int vd_publish_open(struct vd_publish *pub, const char *path, unsigned int queue_size, int policy);
+void vd_publish_event(struct vd_publish *pub, const struct input_event *ev, int keycode, int value, int layer);
+void vd_publish_flush(struct vd_publish *pub);
+int vd_publish_pollfd(struct vd_publish *pub, struct pollfd *fds);
+void vd_publish_poll(struct vd_publish *pub, struct pollfd *fds, int nfds);
+void vd_publish_close(struct vd_publish *pub);
+
+void vd_trace_init(const char *path, unsigned int threshold);
+void vd_trace_record(int probe, int type, int code, int value);
+int vd_trace_dump(const char *path);
+int vd_trace_print(const char *path);
 
 static void interrupt_handler(int sig);
 int test_grab(int fd, int grab_flag);
+int input_event_read_batch(int fd, struct input_event *ev, int count);
+int input_event_is_rule(const char *input);
+int input_event_discover(const char *rule, const char *cache);
+int vd_pipeline_init(struct vd_pipeline *pipeline, struct vd_config *config, int vd_fd, struct vd_publish *publish, struct vd_kodi *kodi);
+int vd_pipeline_run(struct vd_pipeline *pipeline, int count);
+int vd_pipeline_input(struct vd_pipeline *pipeline, int fd);
+void vd_pipeline_free(struct vd_pipeline *pipeline);
+void vd_pipeline_write(struct vd_pipeline *pipeline, int count);
+int vd_sequence_timeout(struct vd_pipeline *pipeline);
+int vd_pipeline_expire(struct vd_pipeline *pipeline);
+void vd_stats_print(FILE *f, const struct vd_pipeline *pipeline);
+
+// input device of the merge, complete frames first, then the incomplete one
+struct vd_source {
+	int fd;
+	struct input_event *queue;
+	int count;
+	int pending;
+};
+
+// k-way merge of the input devices by the ev.time of their frames, a frame
+// waits for the others at most the window
+struct vd_merge {
+	struct timeval window;
+	int count;
+	struct vd_source sources[VD_MERGE_MAX];
+};
+
+void vd_merge_init(struct vd_merge *merge, unsigned int window);
+int vd_merge_add(struct vd_merge *merge, int fd);
+int vd_merge_pollfd(struct vd_merge *merge, struct pollfd *fds);
+int vd_merge_read(struct vd_merge *merge, int i);
+int vd_merge_run(struct vd_merge *merge, struct vd_pipeline *pipeline);
+void vd_merge_free(struct vd_merge *merge);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,249 @@
+/*
+* virtual_input startup benchmark
+*
+* Builds virtual_input.c against a fake uinput (writes go to /dev/null,
+* ioctl() and sleep() are stubbed) and times every startup stage on
+* synthetic keymaps. Peak RSS is reset before each stage through
+* /proc/self/clear_refs, so VmHWM is the peak of that stage only. A config
+* is saved and read back first, the settings must survive vd_config_save().
+*
+* usage: virtual_input_bench [mappings ...]
+*/
+#define VD_UINPUT_PATH "/dev/null"
+#define ioctl vd_bench_ioctl
+#define sleep vd_bench_sleep
+#define main virtual_input_main
+#include "virtual_input.c"
+#undef main
+#undef sleep
+#undef ioctl
+
+#define BENCH_DENSE 0
+#define BENCH_SPARSE 1
+#define BENCH_DUPLICATES 2
+
+static const char * const bench_patterns[] = {"dense", "sparse", "duplicates"};
+int vd_bench_ioctl(int fd, unsigned long request, ...)
+{
+	return 0;
+}
+
+unsigned int vd_bench_sleep(unsigned int seconds)
+{
+	return 0;
+}
+
+static void bench_rss_reset(void)
+{
+	FILE *f;
+
+	if ((f = fopen("/proc/self/clear_refs", "w")) != NULL) {
+		fputs("5", f);
+		fclose(f);
+	}
+}
+
+// kB, -1 if unknown
+static long bench_rss_peak(void)
+{
+	FILE *f;
+	char line[256];
+	long kb = -1;
+
+	if ((f = fopen("/proc/self/status", "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+static double bench_ms(struct timespec *start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void bench_report(const char *stage, int mappings, int pattern, struct timespec *start)
+{
+	double ms = bench_ms(start);
+	fprintf(stdout, "%-16s %8d %-10s %12.3f ms %10ld kB\n", stage, mappings, bench_patterns[pattern], ms, bench_rss_peak());
+}
+
+// a stage that failed or did not run has no time to report
+static void bench_report_status(const char *stage, int mappings, int pattern, const char *status)
+{
+	fprintf(stdout, "%-16s %8d %-10s %15s %13s\n", stage, mappings, bench_patterns[pattern], status, "-");
+}
+
+static int bench_scancode(int i, int pattern)
+{
+	switch (pattern) {
+	case BENCH_SPARSE:
+		return (int)(((unsigned int)i * 2654435761U) & 0x7FFFFFFF);
+	case BENCH_DUPLICATES:
+		return i / 2;
+	default:
+		return i;
+	}
+}
+
+static const char *bench_key(int i)
+{
+	static int names[KEY_MAX + 1], count;
+	int code;
+
+	if (count == 0)
+		for (code = 1; code < KEY_MAX; code++)
+			if (keys[code] != NULL)
+				names[count++] = code;
+	return keys[names[i % count]];
+}
+
+static char *bench_config(int mappings, int pattern, size_t *size)
+{
+	FILE *f;
+	char *buf = NULL;
+	int i;
+
+	f = open_memstream(&buf, size);
+	fprintf(f, "name bench\ninput /dev/null\nbegin codes\n");
+	for (i = 0; i < mappings; i++)
+		fprintf(f, "  %-20s 0x%08X\n", bench_key(i), bench_scancode(i, pattern));
+	fprintf(f, "end codes\n");
+	fclose(f);
+	return buf;
+}
+
+static void bench_config_free(struct vd_config *config)
+{
+	struct vk_node *node, *next;
+	unsigned int i;
+
+	for (node = config->vks; node != NULL; node = next) {
+		next = node->next;
+		free(node->key);
+		free(node->kodi);
+		free(node);
+	}
+	for (i = 0; i < config->layer_count; i++) {
+		free(config->layers[i].table);
+		if (i > 0)
+			free(config->layers[i].name);
+	}
+	free(config->layers);
+	free(config->name);
+	free(config->input);
+	memset(config, 0, sizeof(*config));
+}
+
+static void bench_run(int mappings, int pattern)
+{
+	struct vd_config config = {0, 0, 0, 0, INT_MAX, 0};
+	struct vk_node *node;
+	struct timespec start;
+	FILE *f;
+	char *text, *key;
+	size_t size;
+	volatile int sum = 0;
+	int i, fd;
+
+	text = bench_config(mappings, pattern, &size);
+
+	bench_rss_reset();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	f = fmemopen(text, size, "r");
+	if (vd_config_read(f, &config))
+		fprintf(stderr, "Error %s (%d) %s(): vd_config_read()\n", __FILE__, __LINE__, __FUNCTION__);
+	fclose(f);
+	bench_report("vd_config_read", mappings, pattern, &start);
+	bench_config_free(&config);
+
+	bench_rss_reset();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < mappings; i++) {
+		key = strdup(bench_key(i));
+		if (!vd_config_add_button(&config, key, bench_scancode(i, pattern)))
+			free(key);
+	}
+	bench_report("add_button", mappings, pattern, &start);
+
+	bench_rss_reset();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	vd_config_table_rebuild(&config);
+	// the table is left empty when the scancode range is too wide
+	if (config.table == NULL)
+		bench_report_status("table_rebuild", mappings, pattern, "failed");
+	else
+		bench_report("table_rebuild", mappings, pattern, &start);
+
+	bench_rss_reset();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (node = config.vks; node != NULL; node = node->next)
+		sum += get_input_code(node->key);
+	bench_report("get_input_code", mappings, pattern, &start);
+
+	// without a table there is nothing to register
+	if (config.table == NULL) {
+		bench_report_status("vd_create", mappings, pattern, "skipped");
+	} else {
+		config.name = strdup("bench");
+		bench_rss_reset();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((fd = vd_create(&config, NULL, 0)) >= 0) {
+			close(fd);
+			bench_report("vd_create", mappings, pattern, &start);
+		} else {
+			bench_report_status("vd_create", mappings, pattern, "failed");
+		}
+	}
+
+	bench_config_free(&config);
+	free(text);
+}
+
+// settings that vd_config_save() must write back, 0 - all survive a save and read
+static int bench_config_roundtrip(void)
+{
+	static const char text[] = "name bench\ninput /dev/null\ncorrect 2\noutput_queue 512\nbegin codes\n  KEY_UP 0x10\nend codes\n";
+	struct vd_config config = {0, 0, 0, 0, INT_MAX, 0}, saved = {0, 0, 0, 0, INT_MAX, 0};
+	char path[] = "/tmp/virtual_input_bench.XXXXXX";
+	FILE *f;
+	int fd, ret = -1;
+
+	if ((fd = mkstemp(path)) < 0)
+		return -1;
+	close(fd);
+	f = fmemopen((void *)text, sizeof(text) - 1, "r");
+	if (vd_config_read(f, &config) == 0 && vd_config_save(path, &config) == 0) {
+		fclose(f);
+		if ((f = fopen(path, "r")) != NULL && vd_config_read(f, &saved) == 0)
+			ret = saved.correct == config.correct && saved.output_queue == config.output_queue ? 0 : -1;
+	}
+	if (f != NULL)
+		fclose(f);
+	unlink(path);
+	fprintf(stdout, "config round-trip %s\n", ret ? "FAILED" : "ok");
+	bench_config_free(&config);
+	bench_config_free(&saved);
+	return ret;
+}
+
+int main(int argc, const char *argv[])
+{
+	static const int defaults[] = {10, 1000, 100000};
+	int i, pattern, mappings;
+
+	if (bench_config_roundtrip())
+		return 1;
+
+	fprintf(stdout, "%-16s %8s %-10s %15s %13s\n", "stage", "mappings", "pattern", "time", "peak rss");
+	for (i = 1; i < argc || (argc == 1 && i <= 3); i++) {
+		mappings = argc > 1 ? atoi(argv[i]) : defaults[i - 1];
+		for (pattern = BENCH_DENSE; pattern <= BENCH_DUPLICATES; pattern++)
+			bench_run(mappings, pattern);
+	}
+	return 0;
+}